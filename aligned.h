@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdlib>
+#include <new>
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
+
+// pixel and depth buffers start on a cache line, so that rows and SIMD
+// stores do not straddle two lines at the start of the buffer
+const size_t CACHE_LINE = 64;
+
+// like new[], throws std::bad_alloc when out of memory; free with alignedFree
+inline void* alignedAlloc(size_t bytes)
+{
+    void* p = NULL;
+#if defined(_WIN32)
+    p = _aligned_malloc(bytes ? bytes : 1, CACHE_LINE);
+#else
+    if (posix_memalign(&p, CACHE_LINE, bytes ? bytes : 1)) p = NULL;
+#endif
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+inline void alignedFree(void* p)
+{
+#if defined(_WIN32)
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
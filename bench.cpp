@@ -0,0 +1,424 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "geometry.h"
+#include "render.h"
+#include "reproject.h"
+#include "rendertarget.h"
+#include "trace.h"
+#include "bench.h"
+
+static volatile float sink;
+
+static double nanoseconds(std::chrono::steady_clock::time_point start, int iterations)
+{
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / iterations;
+}
+
+static Matrix randomMatrix()
+{
+    Matrix m;
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 4; j++) m[i][j] = rand() / (float)RAND_MAX - .5f + (i == j ? 2.f : 0.f);
+    return m;
+}
+
+// the recursive cofactor inverse that mat<> falls back to for other sizes
+static Matrix genericInvert(const Matrix& m)
+{
+    Matrix adjugate = m.adjugate();
+    return (adjugate / (adjugate[0] * m[0])).transpose();
+}
+
+static float maxDifference(const Matrix& a, const Matrix& b)
+{
+    float d = 0;
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 4; j++) d = std::max(d, std::abs(a[i][j] - b[i][j]));
+    return d;
+}
+
+// consumes every element so that no lane of the result can be optimized away
+static float sum(const Vec4f& v)
+{
+    return v[0] + v[1] + v[2] + v[3];
+}
+
+static float sum(const Matrix& m)
+{
+    return sum(m[0]) + sum(m[1]) + sum(m[2]) + sum(m[3]);
+}
+
+static void report(const char* name, double generic, double fast)
+{
+    printf("%-14s generic %8.2f ns  fast %8.2f ns  x%.1f\n", name, generic, fast, generic / fast);
+}
+
+int benchGeometry(int iterations)
+{
+    const int n = 64;
+    Matrix m[n];
+    Vec4f v[n];
+    for (int i = 0; i < n; i++)
+    {
+        m[i] = randomMatrix();
+        for (int j = 0; j < 4; j++) v[i][j] = rand() / (float)RAND_MAX;
+    }
+
+    float error = 0;
+    for (int i = 0; i < n; i++)
+    {
+        Matrix a = m[i];
+        Matrix b = m[(i + 1) % n];
+        error = std::max(error, maxDifference(a * b, operator*<4, 4, 4, float>(a, b)));
+        error = std::max(error, maxDifference(a.invert(), genericInvert(a)));
+        Vec4f p = a * v[i];
+        Vec4f q = operator*<4, 4, float>(a, v[i]);
+        for (int j = 0; j < 4; j++) error = std::max(error, std::abs(p[j] - q[j]));
+    }
+
+    std::chrono::steady_clock::time_point start;
+    double generic, fast;
+    float acc = 0;
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) acc += sum(operator*<4, 4, 4, float>(m[i % n], m[(i + 1) % n]));
+    generic = nanoseconds(start, iterations);
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) acc += sum(m[i % n] * m[(i + 1) % n]);
+    fast = nanoseconds(start, iterations);
+    report("Matrix*Matrix", generic, fast);
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) acc += sum(operator*<4, 4, float>(m[i % n], v[(i + 1) % n]));
+    generic = nanoseconds(start, iterations);
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) acc += sum(m[i % n] * v[(i + 1) % n]);
+    fast = nanoseconds(start, iterations);
+    report("Matrix*Vec4f", generic, fast);
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) acc += operator*<4, float>(v[i % n], v[(i + 1) % n]);
+    generic = nanoseconds(start, iterations);
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) acc += v[i % n] * v[(i + 1) % n];
+    fast = nanoseconds(start, iterations);
+    report("Vec4f*Vec4f", generic, fast);
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) acc += sum(genericInvert(m[i % n]));
+    generic = nanoseconds(start, iterations);
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) acc += sum(m[i % n].invert());
+    fast = nanoseconds(start, iterations);
+    report("invert", generic, fast);
+
+    sink = acc;
+    printf("max difference %g\n", error);
+    return error < 1e-3f ? 0 : 1;
+}
+
+static double milliseconds(std::chrono::steady_clock::time_point start)
+{
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+enum Stage { LOAD, VERTEX, RASTER, FRAGMENT, WRITE, TOTAL, NSTAGES };
+static const char* STAGE_NAMES[NSTAGES] = {"load", "vertex", "raster", "fragment", "write", "total"};
+
+struct Scene
+{
+    std::string name;
+    std::vector<std::string> files;     // relative to the obj directory
+    bool floor;
+    int size;
+    float distance;
+
+    Scene(const std::string& name, bool floor, int size, float distance)
+        : name(name), files(), floor(floor), size(size), distance(distance) {}
+};
+
+// the fixed suite: every model with and without the floor, at a few
+// resolutions and camera distances. Only the maps of the tinyrenderer
+// models are in the tree, their scenes run where the meshes are added;
+// bench/blob.obj is a procedural mesh over the african_head maps that is
+// always there
+static std::vector<Scene> sceneSuite()
+{
+    static const char* MODELS[][4] = {
+        {"african_head", "african_head/african_head.obj", NULL},
+        {"boggie", "boggie/body.obj", "boggie/head.obj", "boggie/eyes.obj"},
+        {"diablo3_pose", "diablo3_pose/diablo3_pose.obj", NULL},
+        {"blob", "bench/blob.obj", NULL},
+    };
+    static const int SIZES[] = {256, 800, 1600};
+    static const float DISTANCES[] = {3, 6};
+
+    std::vector<Scene> scenes;
+    for (int m = 0; m < (int)(sizeof(MODELS) / sizeof(MODELS[0])); m++)
+        for (int floor = 0; floor < 2; floor++)
+            for (int s = 0; s < 3; s++)
+                for (int d = 0; d < 2; d++)
+                {
+                    char name[128];
+                    snprintf(name, sizeof(name), "%s%s_%d_d%g", MODELS[m][0], floor ? "_floor" : "", SIZES[s], DISTANCES[d]);
+                    Scene scene(name, floor != 0, SIZES[s], DISTANCES[d]);
+                    for (int i = 1; i < 4 && MODELS[m][i]; i++) scene.files.push_back(MODELS[m][i]);
+                    if (floor) scene.files.push_back("floor.obj");
+                    scenes.push_back(scene);
+                }
+    return scenes;
+}
+
+// FNV-1a over the rendered pixels
+static unsigned long long imageHash(TGAImage& image)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    const unsigned char* p = image.buffer();
+    long n = (long)image.get_width() * image.get_height() * image.get_bytespp();
+    for (long i = 0; i < n; i++)
+    {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// the scenes share their framebuffers, as a batch renderer would
+static RenderTargetPool targets;
+
+// renders the scene once, the way main does, and fills in the time of every
+// stage and the pipeline counters; with prepass the models are drawn with
+// the depth pre-pass and overdraw, when not NULL, gets the fragments a
+// single pass would shade per visible pixel of each model; depth is the
+// format of the depth buffer, rate the shading rate of the draws, and copy,
+// when not NULL, gets the image
+static unsigned long long renderScene(const Scene& scene, const std::string& objDir, double* times, PipelineStats& stats,
+                                      bool prepass = false, std::vector<double>* overdraw = NULL,
+                                      DepthFormat depth = DEPTH_FLOAT32, TGAImage* copy = NULL, int rate = 1)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<Model*> models;
+    for (size_t i = 0; i < scene.files.size(); i++) models.push_back(new Model((objDir + "/" + scene.files[i]).c_str()));
+    times[LOAD] = milliseconds(start);
+
+    TGAImage& image = *targets.acquireColor(scene.size, scene.size, TGAImage::RGB);
+    zbuffer& zbuffer = *targets.acquireDepth(scene.size, scene.size, depth);
+    modelView(Vec3f(0, 0, 0), Vec3f(0, 0, 0));
+    cameraView(Vec3f(0, 0, scene.distance), Vec3f(0, 180, 0));
+    perspective(-1, -10.f, 45, 1);
+    ndcView(-1, -10.f, 45, 1);
+    viewport(scene.size, scene.size);
+    setUniforms(Vec3f(0, 0, -1));
+
+    // the stage split comes from the pipeline cycle counters, scaled to
+    // the wall clock time of all the draws
+    GouraudShader gouraud;
+    flootShader floor;
+    threadStats.clear();
+    unsigned long long begin = cycleCount();
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < models.size(); i++)
+    {
+        bool isFloor = scene.floor && i + 1 == models.size();
+        model = models[i];
+        long long shaded = threadStats.pixelsShaded, depthOnly = threadStats.pixelsDepthOnly;
+        drawModel(isFloor ? (IShader&)floor : (IShader&)gouraud, image, zbuffer, NULL, prepass, rate);
+        shaded = threadStats.pixelsShaded - shaded;
+        if (overdraw) overdraw->push_back(shaded ? (double)(threadStats.pixelsDepthOnly - depthOnly) / shaded : 0);
+    }
+    double draw = milliseconds(start);
+    unsigned long long drawCycles = cycleCount() - begin;
+    model = NULL;
+    stats.clear();
+    mergeThreadStats(stats);
+    times[VERTEX] = drawCycles ? draw * stats.cycles[STAGE_VERTEX] / drawCycles : 0;
+    times[FRAGMENT] = drawCycles ? draw * stats.cycles[STAGE_FRAGMENT] / drawCycles : 0;
+    times[RASTER] = draw - times[VERTEX] - times[FRAGMENT];
+    unsigned long long hash = imageHash(image);
+    if (copy) *copy = image;
+
+    // the file is encoded into memory, so that the write stage times the
+    // encoder and nothing is left behind
+    start = std::chrono::steady_clock::now();
+    {
+        TRACE_SCOPE("write image");
+        std::ostringstream file;
+        image.write_tga(file, true, true, std::max(1u, std::thread::hardware_concurrency()));
+    }
+    times[WRITE] = milliseconds(start);
+
+    for (size_t i = 0; i < models.size(); i++) delete models[i];
+    targets.release(&image);
+    targets.release(&zbuffer);
+    times[TOTAL] = times[LOAD] + draw + times[WRITE];
+    return hash;
+}
+
+static double percentile(std::vector<double> samples, double p)
+{
+    std::sort(samples.begin(), samples.end());
+    size_t i = (size_t)std::ceil(p * samples.size());
+    return samples[i ? i - 1 : 0];
+}
+
+static bool fileExists(const std::string& path)
+{
+    std::ifstream in(path.c_str());
+    return in.good();
+}
+
+int benchScenes(const char* objDir, const char* hashFile, int repeat, bool recordHashes)
+{
+    if (repeat < 1) repeat = 1;
+    std::map<std::string, std::string> expected;
+    std::ifstream in(hashFile);
+    std::string name, hash;
+    while (in >> name >> hash) expected[name] = hash;
+    bool record = false;
+    int changed = 0;
+    int unknown = 0;
+    int ran = 0;
+
+    std::vector<Scene> scenes = sceneSuite();
+    printf("{\n  \"repeat\": %d,\n  \"scenes\": [", repeat);
+    for (size_t s = 0; s < scenes.size(); s++)
+    {
+        const Scene& scene = scenes[s];
+        // the maps of the next scene are read while this one renders
+        if (s + 1 < scenes.size())
+        {
+            for (size_t i = 0; i < scenes[s + 1].files.size(); i++)
+                Model::prefetch_textures((std::string(objDir) + "/" + scenes[s + 1].files[i]).c_str());
+        }
+        printf("%s\n    {\"name\": \"%s\", ", s ? "," : "", scene.name.c_str());
+
+        bool missing = false;
+        for (size_t i = 0; i < scene.files.size(); i++) missing |= !fileExists(std::string(objDir) + "/" + scene.files[i]);
+        if (missing)
+        {
+            printf("\"status\": \"skipped\"}");
+            continue;
+        }
+        ran++;
+
+        double times[NSTAGES];
+        PipelineStats stats;
+        std::vector<double> samples[NSTAGES];
+        TGAImage reference;
+        unsigned long long first = renderScene(scene, objDir, times, stats, false, NULL, DEPTH_FLOAT32, &reference); // warm up
+        bool deterministic = true;
+        for (int r = 0; r < repeat; r++)
+        {
+            deterministic &= renderScene(scene, objDir, times, stats) == first;
+            for (int i = 0; i < NSTAGES; i++) samples[i].push_back(times[i]);
+        }
+
+        char digest[17];
+        snprintf(digest, sizeof(digest), "%016llx", first);
+        const char* status = "ok";
+        if (!deterministic) status = "nondeterministic";
+        else if (!expected.count(scene.name) && recordHashes)
+        {
+            status = "new";
+            expected[scene.name] = digest;
+            record = true;
+        }
+        else if (!expected.count(scene.name))
+        {
+            status = "unknown";
+            unknown++;
+        }
+        else if (expected[scene.name] != digest) status = "changed";
+        changed += strcmp(status, "ok") && strcmp(status, "new") && strcmp(status, "unknown");
+
+        printf("\"status\": \"%s\", \"hash\": \"%s\"", status, digest);
+        for (int i = 0; i < NSTAGES; i++)
+        {
+            printf(", \"%s\": {\"median\": %.3f, \"p95\": %.3f}", STAGE_NAMES[i],
+                   percentile(samples[i], .5), percentile(samples[i], .95));
+        }
+
+        // once more with the depth pre-pass, which must give the same image
+        double prepassTimes[NSTAGES];
+        PipelineStats prepassStats;
+        std::vector<double> overdraw;
+        bool same = renderScene(scene, objDir, prepassTimes, prepassStats, true, &overdraw) == first;
+        changed += !same;
+        printf(", \"prepass\": {\"total\": %.3f, \"same_image\": %s, \"overdraw\": {", prepassTimes[TOTAL], same ? "true" : "false");
+        for (size_t i = 0; i < overdraw.size(); i++) printf("%s\"%s\": %.3f", i ? ", " : "", scene.files[i].c_str(), overdraw[i]);
+        printf("}}");
+
+        // and with the reduced precision depth formats, against the float depth image
+        static const DepthFormat DEPTH_FORMATS[2] = {DEPTH_UNORM24, DEPTH_UNORM16};
+        static const char* DEPTH_NAMES[2] = {"unorm24", "unorm16"};
+        printf(", \"depth\": {");
+        for (int i = 0; i < 2; i++)
+        {
+            double depthTimes[NSTAGES];
+            PipelineStats depthStats;
+            TGAImage image;
+            renderScene(scene, objDir, depthTimes, depthStats, false, NULL, DEPTH_FORMATS[i], &image);
+            int differing;
+            double error = psnr(reference, image, differing);
+            printf("%s\"%s\": {\"total\": %.3f, \"differing\": %d, \"psnr\": ", i ? ", " : "", DEPTH_NAMES[i], depthTimes[TOTAL], differing);
+            if (std::isinf(error)) printf("null}");
+            else printf("%.2f}", error);
+        }
+        printf("}");
+
+        // and with coarse shading: the fragment() calls left of the full rate, and the error
+        static const int RATES[3] = {2, 4, SHADING_RATE_AUTO};
+        static const char* RATE_NAMES[3] = {"2x2", "4x4", "auto"};
+        printf(", \"shading_rate\": {");
+        for (int i = 0; i < 3; i++)
+        {
+            double rateTimes[NSTAGES];
+            PipelineStats rateStats;
+            TGAImage image;
+            renderScene(scene, objDir, rateTimes, rateStats, false, NULL, DEPTH_FLOAT32, &image, RATES[i]);
+            int differing;
+            double error = psnr(reference, image, differing);
+            printf("%s\"%s\": {\"total\": %.3f, \"shaded\": %.3f, \"differing\": %d, \"psnr\": ", i ? ", " : "", RATE_NAMES[i],
+                   rateTimes[TOTAL], stats.pixelsShaded ? (double)rateStats.pixelsShaded / stats.pixelsShaded : 0., differing);
+            if (std::isinf(error)) printf("null}");
+            else printf("%.2f}", error);
+        }
+        printf("}");
+
+        printf(", \"stats\": ");
+        stats.writeJson(stdout);
+        printf("}");
+        fflush(stdout);
+    }
+    TextureCache::Counters cache = textureCache.counters();
+    printf("\n  ],\n  \"texture_cache\": {\"loads\": %lld, \"hits\": %lld, \"duplicates\": %lld, \"evictions\": %lld, "
+           "\"prefetches_held\": %lld, \"prefetches_cancelled\": %lld, \"kb\": %zu}\n}\n",
+           cache.loads, cache.hits, cache.duplicates, cache.evictions, cache.held, cache.cancelled, cache.bytes / 1024);
+
+    // with recordHashes scenes seen for the first time become part of the
+    // reference; a changed hash is never overwritten, delete its line to
+    // accept the new output
+    if (record)
+    {
+        std::ofstream out(hashFile);
+        for (std::map<std::string, std::string>::iterator it = expected.begin(); it != expected.end(); ++it)
+            out << it->first << " " << it->second << "\n";
+    }
+    if (changed) fprintf(stderr, "# bench: %d scene(s) changed output\n", changed);
+    if (unknown) fprintf(stderr, "# bench: %d scene(s) not in %s, run with --record-hashes to add them\n", unknown, hashFile);
+    // a bench that found none of its meshes measured nothing
+    if (!ran) fprintf(stderr, "# bench: no scene found its meshes under %s\n", objDir);
+    return changed || unknown || !ran ? 1 : 0;
+}
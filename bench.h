@@ -0,0 +1,12 @@
+#pragma once
+
+// micro-benchmarks of the SIMD geometry paths against the generic templates;
+// returns non-zero when the two disagree
+int benchGeometry(int iterations);
+
+// renders the fixed scene suite found under objDir repeat times per scene
+// after a warm-up run and prints the median and 95th percentile of every
+// stage as JSON. Output hashes are checked against hashFile; scenes it does
+// not know yet are added to it with recordHashes and are failures without.
+// Returns non-zero when an image changed or was not known.
+int benchScenes(const char* objDir, const char* hashFile, int repeat, bool recordHashes = false);
@@ -21,25 +21,53 @@ template <typename T> struct vec<2,T> {
     vec() : x(T()), y(T()) {}
     vec(T X, T Y) : x(X), y(Y) {}
     template <class U> vec<2,T>(const vec<2,U> &v);
-          T& operator[](const size_t i)       { assert(i<2); return i<=0 ? x : y; }
-    const T& operator[](const size_t i) const { assert(i<2); return i<=0 ? x : y; }
+          T& operator[](const size_t i)       { assert(i<2); return this->*members[i]; }
+    const T& operator[](const size_t i) const { assert(i<2); return this->*members[i]; }
 
     T x,y;
+private:
+    static T vec<2,T>::* const members[2];
 };
 
+template <typename T> T vec<2,T>::* const vec<2,T>::members[2] = { &vec<2,T>::x, &vec<2,T>::y };
+
 /////////////////////////////////////////////////////////////////////////////////
 
 template <typename T> struct vec<3,T> {
     vec() : x(T()), y(T()), z(T()) {}
     vec(T X, T Y, T Z) : x(X), y(Y), z(Z) {}
     template <class U> vec<3,T>(const vec<3,U> &v);
-          T& operator[](const size_t i)       { assert(i<3); return i<=0 ? x : (1==i ? y : z); }
-    const T& operator[](const size_t i) const { assert(i<3); return i<=0 ? x : (1==i ? y : z); }
+          T& operator[](const size_t i)       { assert(i<3); return this->*members[i]; }
+    const T& operator[](const size_t i) const { assert(i<3); return this->*members[i]; }
     float norm() { return std::sqrt(x*x+y*y+z*z); }
     vec<3,T> & normalize(T l=1) { *this = (*this)*(l/norm()); return *this; }
 
     T x,y,z;
+private:
+    static T vec<3,T>::* const members[3];
+};
+
+template <typename T> T vec<3,T>::* const vec<3,T>::members[3] = { &vec<3,T>::x, &vec<3,T>::y, &vec<3,T>::z };
+
+/////////////////////////////////////////////////////////////////////////////////
+
+#if !defined(GEOMETRY_NO_SIMD) && (defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1))
+#define GEOMETRY_SSE
+#include <xmmintrin.h>
+
+// Vec4f lives in an SSE register; the lanes alias the usual float indices
+template <> struct vec<4,float> {
+    vec() : m(_mm_setzero_ps()) {}
+    explicit vec(__m128 v) : m(v) {}
+          float& operator[](const size_t i)       { assert(i<4); return data_[i]; }
+    const float& operator[](const size_t i) const { assert(i<4); return data_[i]; }
+
+    union {
+        __m128 m;
+        float data_[4];
+    };
 };
+#endif
 
 /////////////////////////////////////////////////////////////////////////////////
 
@@ -211,6 +239,101 @@ template <size_t DimRows,size_t DimCols,class T> std::ostream& operator<<(std::o
 
 /////////////////////////////////////////////////////////////////////////////////
 
+#ifdef GEOMETRY_SSE
+// non-template overloads win over the generic templates above
+
+inline vec<4,float> operator+(const vec<4,float>& lhs, const vec<4,float>& rhs) {
+    return vec<4,float>(_mm_add_ps(lhs.m, rhs.m));
+}
+
+inline vec<4,float> operator-(const vec<4,float>& lhs, const vec<4,float>& rhs) {
+    return vec<4,float>(_mm_sub_ps(lhs.m, rhs.m));
+}
+
+inline vec<4,float> operator*(const vec<4,float>& lhs, float rhs) {
+    return vec<4,float>(_mm_mul_ps(lhs.m, _mm_set1_ps(rhs)));
+}
+
+inline vec<4,float> operator/(const vec<4,float>& lhs, float rhs) {
+    return vec<4,float>(_mm_div_ps(lhs.m, _mm_set1_ps(rhs)));
+}
+
+inline float operator*(const vec<4,float>& lhs, const vec<4,float>& rhs) {
+    __m128 p = _mm_mul_ps(lhs.m, rhs.m);
+    p = _mm_add_ps(p, _mm_movehl_ps(p, p));
+    p = _mm_add_ss(p, _mm_shuffle_ps(p, p, 1));
+    return _mm_cvtss_f32(p);
+}
+
+// the four row products are transposed so that one vertical add sums them
+inline vec<4,float> operator*(const mat<4,4,float>& lhs, const vec<4,float>& rhs) {
+    __m128 r0 = _mm_mul_ps(lhs[0].m, rhs.m);
+    __m128 r1 = _mm_mul_ps(lhs[1].m, rhs.m);
+    __m128 r2 = _mm_mul_ps(lhs[2].m, rhs.m);
+    __m128 r3 = _mm_mul_ps(lhs[3].m, rhs.m);
+    _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+    return vec<4,float>(_mm_add_ps(_mm_add_ps(r0, r1), _mm_add_ps(r2, r3)));
+}
+
+// row i of the product is a combination of the rows of rhs, no columns needed
+inline mat<4,4,float> operator*(const mat<4,4,float>& lhs, const mat<4,4,float>& rhs) {
+    mat<4,4,float> result;
+    for (size_t i=4; i--; ) {
+        const vec<4,float>& l = lhs[i];
+        __m128 r = _mm_mul_ps(_mm_set1_ps(l[0]), rhs[0].m);
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(l[1]), rhs[1].m));
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(l[2]), rhs[2].m));
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(l[3]), rhs[3].m));
+        result[i] = vec<4,float>(r);
+    }
+    return result;
+}
+#endif
+
+// closed form 4x4 inverse from the 2x2 sub-determinants of the upper and
+// lower row pairs, instead of the recursive cofactor expansion
+template<> inline mat<4,4,float> mat<4,4,float>::invert() {
+    const mat<4,4,float>& m = *this;
+    float s0 = m[0][0]*m[1][1] - m[1][0]*m[0][1];
+    float s1 = m[0][0]*m[1][2] - m[1][0]*m[0][2];
+    float s2 = m[0][0]*m[1][3] - m[1][0]*m[0][3];
+    float s3 = m[0][1]*m[1][2] - m[1][1]*m[0][2];
+    float s4 = m[0][1]*m[1][3] - m[1][1]*m[0][3];
+    float s5 = m[0][2]*m[1][3] - m[1][2]*m[0][3];
+    float c5 = m[2][2]*m[3][3] - m[3][2]*m[2][3];
+    float c4 = m[2][1]*m[3][3] - m[3][1]*m[2][3];
+    float c3 = m[2][1]*m[3][2] - m[3][1]*m[2][2];
+    float c2 = m[2][0]*m[3][3] - m[3][0]*m[2][3];
+    float c1 = m[2][0]*m[3][2] - m[3][0]*m[2][2];
+    float c0 = m[2][0]*m[3][1] - m[3][0]*m[2][1];
+    float inv = 1.f / (s0*c5 - s1*c4 + s2*c3 + s3*c2 - s4*c1 + s5*c0);
+
+    mat<4,4,float> r;
+    r[0][0] = ( m[1][1]*c5 - m[1][2]*c4 + m[1][3]*c3) * inv;
+    r[0][1] = (-m[0][1]*c5 + m[0][2]*c4 - m[0][3]*c3) * inv;
+    r[0][2] = ( m[3][1]*s5 - m[3][2]*s4 + m[3][3]*s3) * inv;
+    r[0][3] = (-m[2][1]*s5 + m[2][2]*s4 - m[2][3]*s3) * inv;
+    r[1][0] = (-m[1][0]*c5 + m[1][2]*c2 - m[1][3]*c1) * inv;
+    r[1][1] = ( m[0][0]*c5 - m[0][2]*c2 + m[0][3]*c1) * inv;
+    r[1][2] = (-m[3][0]*s5 + m[3][2]*s2 - m[3][3]*s1) * inv;
+    r[1][3] = ( m[2][0]*s5 - m[2][2]*s2 + m[2][3]*s1) * inv;
+    r[2][0] = ( m[1][0]*c4 - m[1][1]*c2 + m[1][3]*c0) * inv;
+    r[2][1] = (-m[0][0]*c4 + m[0][1]*c2 - m[0][3]*c0) * inv;
+    r[2][2] = ( m[3][0]*s4 - m[3][1]*s2 + m[3][3]*s0) * inv;
+    r[2][3] = (-m[2][0]*s4 + m[2][1]*s2 - m[2][3]*s0) * inv;
+    r[3][0] = (-m[1][0]*c3 + m[1][1]*c1 - m[1][2]*c0) * inv;
+    r[3][1] = ( m[0][0]*c3 - m[0][1]*c1 + m[0][2]*c0) * inv;
+    r[3][2] = (-m[3][0]*s3 + m[3][1]*s1 - m[3][2]*s0) * inv;
+    r[3][3] = ( m[2][0]*s3 - m[2][1]*s1 + m[2][2]*s0) * inv;
+    return r;
+}
+
+template<> inline mat<4,4,float> mat<4,4,float>::invert_transpose() {
+    return invert().transpose();
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
 typedef vec<2,  float> Vec2f;
 typedef vec<2,  int>   Vec2i;
 typedef vec<3,  float> Vec3f;
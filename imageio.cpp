@@ -0,0 +1,272 @@
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <vector>
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#endif
+#include "imageio.h"
+
+ImageFormat imageFormat(const std::string& nameOrFilename)
+{
+    std::string ext = nameOrFilename.substr(nameOrFilename.find_last_of('.') + 1);
+    for (size_t i = 0; i < ext.size(); i++) ext[i] = (char)tolower(ext[i]);
+    if (ext == "ppm" || ext == "pgm") return FORMAT_PPM;
+    if (ext == "pam") return FORMAT_PAM;
+    if (ext == "png") return FORMAT_PNG;
+    return FORMAT_TGA;
+}
+
+bool isImageFormat(const std::string& name)
+{
+    std::string lower(name);
+    for (size_t i = 0; i < lower.size(); i++) lower[i] = (char)tolower(lower[i]);
+    return lower == "tga" || lower == "ppm" || lower == "pgm" || lower == "pam" || lower == "png";
+}
+
+// copies row y, counting from the top, into rgb order with channels of the
+// output per pixel; the only conversion buffer is this one row
+static void convertRow(TGAImage& image, int y, int channels, unsigned char* row)
+{
+    int bytespp = image.get_bytespp();
+    const unsigned char* src = image.buffer() + (size_t)(image.get_height() - 1 - y) * image.get_width() * bytespp;
+    if (bytespp == 1)
+    {
+        memcpy(row, src, image.get_width());
+        return;
+    }
+    for (int x = 0; x < image.get_width(); x++, src += bytespp, row += channels)
+    {
+        row[0] = src[2];
+        row[1] = src[1];
+        row[2] = src[0];
+        if (channels == 4) row[3] = src[3];
+    }
+}
+
+static bool writeRows(TGAImage& image, int channels, FILE* out)
+{
+    std::vector<unsigned char> row((size_t)image.get_width() * channels);
+    for (int y = 0; y < image.get_height(); y++)
+    {
+        convertRow(image, y, channels, row.data());
+        if (fwrite(row.data(), 1, row.size(), out) != row.size()) return false;
+    }
+    return true;
+}
+
+bool writePpm(TGAImage& image, FILE* out)
+{
+    int channels = image.get_bytespp() == TGAImage::GRAYSCALE ? 1 : 3;
+    fprintf(out, "P%d\n%d %d\n255\n", channels == 1 ? 5 : 6, image.get_width(), image.get_height());
+    return writeRows(image, channels, out);
+}
+
+bool writePam(TGAImage& image, FILE* out)
+{
+    int channels = image.get_bytespp();
+    const char* tuple = channels == 1 ? "GRAYSCALE" : channels == 3 ? "RGB" : "RGB_ALPHA";
+    fprintf(out, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL 255\nTUPLTYPE %s\nENDHDR\n",
+            image.get_width(), image.get_height(), channels, tuple);
+    return writeRows(image, channels, out);
+}
+
+// CRC-32 (as in PNG and zlib), eight bytes per step through eight tables
+struct Crc32
+{
+    unsigned int table[8][256];
+
+    Crc32()
+    {
+        for (unsigned int i = 0; i < 256; i++)
+        {
+            unsigned int c = i;
+            for (int k = 0; k < 8; k++) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            table[0][i] = c;
+        }
+        for (int t = 1; t < 8; t++)
+            for (int i = 0; i < 256; i++) table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xff];
+    }
+
+    unsigned int update(unsigned int crc, const unsigned char* p, size_t n) const
+    {
+        crc = ~crc;
+        for (; n >= 8; n -= 8, p += 8)
+        {
+            unsigned int lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24);
+            unsigned int hi = p[4] | p[5] << 8 | p[6] << 16 | (unsigned int)p[7] << 24;
+            crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^ table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+                  table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^ table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+        }
+        for (; n; n--, p++) crc = table[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+        return ~crc;
+    }
+};
+
+static const Crc32 crc32;
+
+// Adler-32, taking the modulo only every 5552 bytes, the most that cannot
+// overflow 32 bits
+static unsigned int adler32(unsigned int adler, const unsigned char* p, size_t n)
+{
+    unsigned int a = adler & 0xffff;
+    unsigned int b = adler >> 16;
+    while (n)
+    {
+        size_t block = n < 5552 ? n : 5552;
+        n -= block;
+        for (; block; block--) b += a += *p++;
+        a %= 65521;
+        b %= 65521;
+    }
+    return a | b << 16;
+}
+
+static void putBigEndian(unsigned char* p, unsigned int v)
+{
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+// writes a PNG chunk whose data is the concatenation of count pieces
+static void writeChunk(FILE* out, const char* type, const unsigned char* const* pieces, const size_t* sizes, int count, bool& ok)
+{
+    unsigned char bytes[4];
+    size_t length = 0;
+    for (int i = 0; i < count; i++) length += sizes[i];
+    putBigEndian(bytes, (unsigned int)length);
+    ok = ok && fwrite(bytes, 1, 4, out) == 4 && fwrite(type, 1, 4, out) == 4;
+
+    unsigned int crc = crc32.update(0, (const unsigned char*)type, 4);
+    for (int i = 0; i < count; i++)
+    {
+        crc = crc32.update(crc, pieces[i], sizes[i]);
+        ok = ok && fwrite(pieces[i], 1, sizes[i], out) == sizes[i];
+    }
+    putBigEndian(bytes, crc);
+    ok = ok && fwrite(bytes, 1, 4, out) == 4;
+}
+
+// Streams the zlib data of a PNG as stored deflate blocks, one block per
+// IDAT chunk, so that only one block is ever buffered.
+struct PngStream
+{
+    static const size_t BLOCK = 65535;  // largest stored block
+
+    FILE* out;
+    std::vector<unsigned char> block;
+    size_t used;
+    bool first;
+    unsigned int adler;
+    bool ok;
+
+    PngStream(FILE* out) : out(out), block(BLOCK), used(0), first(true), adler(1), ok(true) {}
+
+    PngStream(const PngStream&) = delete;
+    PngStream& operator=(const PngStream&) = delete;
+
+    void flush(bool last)
+    {
+        unsigned char header[2 + 5];
+        size_t n = 0;
+        if (first)
+        {
+            // deflate with a 32K window and no dictionary, checksum divisible by 31
+            header[n++] = 0x78;
+            header[n++] = 0x01;
+        }
+        header[n++] = last ? 1 : 0;     // BFINAL, BTYPE 00 (stored)
+        header[n++] = (unsigned char)used;
+        header[n++] = (unsigned char)(used >> 8);
+        header[n++] = (unsigned char)~used;
+        header[n++] = (unsigned char)(~used >> 8);
+
+        adler = adler32(adler, block.data(), used);
+        unsigned char trailer[4];
+        putBigEndian(trailer, adler);
+
+        const unsigned char* pieces[3] = { header, block.data(), trailer };
+        size_t sizes[3] = { n, used, last ? 4u : 0u };
+        writeChunk(out, "IDAT", pieces, sizes, 3, ok);
+        first = false;
+        used = 0;
+    }
+
+    void write(const unsigned char* p, size_t n)
+    {
+        while (n)
+        {
+            size_t take = std::min(n, BLOCK - used);
+            memcpy(block.data() + used, p, take);
+            used += take;
+            p += take;
+            n -= take;
+            if (used == BLOCK) flush(false);
+        }
+    }
+};
+
+bool writePng(TGAImage& image, FILE* out)
+{
+    int width = image.get_width();
+    int height = image.get_height();
+    int channels = image.get_bytespp();
+    bool ok = fwrite("\x89PNG\r\n\x1a\n", 1, 8, out) == 8;
+
+    unsigned char ihdr[13] = { 0 };
+    putBigEndian(ihdr, width);
+    putBigEndian(ihdr + 4, height);
+    ihdr[8] = 8;                                            // bit depth
+    ihdr[9] = channels == 1 ? 0 : channels == 3 ? 2 : 6;    // gray, rgb, rgba
+    const unsigned char* pieces[1] = { ihdr };
+    size_t sizes[1] = { sizeof(ihdr) };
+    writeChunk(out, "IHDR", pieces, sizes, 1, ok);
+
+    // every scanline starts with its filter type, 0 for none
+    PngStream stream(out);
+    std::vector<unsigned char> row(1 + (size_t)width * channels, 0);
+    for (int y = 0; y < height; y++)
+    {
+        convertRow(image, y, channels, &row[1]);
+        stream.write(row.data(), row.size());
+    }
+    stream.flush(true);
+
+    writeChunk(out, "IEND", pieces, sizes, 0, ok);
+    return ok && stream.ok;
+}
+
+bool writeImage(TGAImage& image, const std::string& filename, ImageFormat format, int threads)
+{
+    if (format == FORMAT_TGA)
+    {
+        if (filename == "-")
+        {
+            fprintf(stderr, "tga output needs a file\n");
+            return false;
+        }
+        return image.write_tga_file(filename.c_str(), true, true, threads);
+    }
+
+    FILE* out = stdout;
+    if (filename == "-")
+    {
+#if defined(_WIN32)
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    }
+    else if (!(out = fopen(filename.c_str(), "wb")))
+    {
+        fprintf(stderr, "can't open file %s\n", filename.c_str());
+        return false;
+    }
+
+    bool ok = format == FORMAT_PPM ? writePpm(image, out) : format == FORMAT_PAM ? writePam(image, out) : writePng(image, out);
+    ok = fflush(out) == 0 && ok;
+    if (out != stdout) ok = fclose(out) == 0 && ok;
+    if (!ok) fprintf(stderr, "can't write %s\n", filename.c_str());
+    return ok;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include "tgaimage.h"
+
+// Output formats other than TGA, all written straight from the framebuffer
+// (row 0 at the bottom, as rendered) one row at a time, never through a
+// converted copy of the image.
+enum ImageFormat { FORMAT_TGA, FORMAT_PPM, FORMAT_PAM, FORMAT_PNG };
+
+// from a name (tga, ppm, pam, png) or a file extension; TGA when unknown
+ImageFormat imageFormat(const std::string& nameOrFilename);
+// whether name is one of those names, for options that must not fall back
+bool isImageFormat(const std::string& name);
+
+// binary PPM (PGM for grayscale, alpha is dropped)
+bool writePpm(TGAImage& image, FILE* out);
+// PAM with the matching tuple type, keeps alpha
+bool writePam(TGAImage& image, FILE* out);
+// PNG with stored (uncompressed) deflate blocks, no zlib needed
+bool writePng(TGAImage& image, FILE* out);
+
+// writes image to filename, or to stdout for "-", which suits piping a
+// stream of PPM/PAM frames into ffmpeg or a compositor; TGA needs a file,
+// threads is how many threads its RLE encoder may use
+bool writeImage(TGAImage& image, const std::string& filename, ImageFormat format, int threads = 1);
@@ -0,0 +1,96 @@
+#include <algorithm>
+#include "imagewriter.h"
+#include "trace.h"
+
+ImageWriter::ImageWriter(int queueSize, int encodeThreads)
+    : queueSize(std::max(1, queueSize)), encodeThreads(std::max(1, encodeThreads)), mutex(), changed(),
+      queue(), spare(), images(), writing(false), failed(false), stopping(false), thread()
+{
+    thread = std::thread(&ImageWriter::run, this);
+}
+
+ImageWriter::~ImageWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    thread.join();
+    for (size_t i = 0; i < images.size(); i++) delete images[i];
+}
+
+TGAImage* ImageWriter::acquire(int width, int height, int bytespp)
+{
+    TGAImage* image = NULL;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] { return (int)queue.size() < queueSize; });
+        for (size_t i = 0; i < spare.size(); i++)
+        {
+            TGAImage* s = spare[i];
+            if (s->get_width() == width && s->get_height() == height && s->get_bytespp() == bytespp)
+            {
+                image = s;
+                spare.erase(spare.begin() + i);
+                break;
+            }
+        }
+        if (!image)
+        {
+            image = new TGAImage(width, height, bytespp);
+            images.push_back(image);
+            return image;
+        }
+    }
+    image->clear();
+    return image;
+}
+
+void ImageWriter::submit(TGAImage* image, const std::string& filename, ImageFormat format)
+{
+    Job job = { image, filename, format };
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(job);
+    }
+    changed.notify_all();
+}
+
+bool ImageWriter::finish()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this] { return queue.empty() && !writing; });
+    bool ok = !failed;
+    failed = false;
+    return ok;
+}
+
+void ImageWriter::run()
+{
+    traceThreadRole("encode");
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;)
+    {
+        changed.wait(lock, [this] { return stopping || !queue.empty(); });
+        if (queue.empty()) return;
+
+        Job job = queue.front();
+        queue.pop_front();
+        writing = true;
+        lock.unlock();
+        changed.notify_all();
+
+        bool ok;
+        {
+            TRACE_SCOPE("write image");
+            ok = writeImage(*job.image, job.filename, job.format, encodeThreads);
+        }
+
+        lock.lock();
+        failed |= !ok;
+        spare.push_back(job.image);
+        writing = false;
+        changed.notify_all();
+    }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "tgaimage.h"
+#include "imageio.h"
+
+// Encodes and writes finished frames on a background thread so that the
+// next frame renders meanwhile. At most queueSize frames wait to be written,
+// and the framebuffers of written frames are handed out again by acquire().
+class ImageWriter
+{
+public:
+    ImageWriter(int queueSize = 2, int encodeThreads = 1);
+    ~ImageWriter();
+
+    ImageWriter(const ImageWriter&) = delete;
+    ImageWriter& operator=(const ImageWriter&) = delete;
+
+    // a cleared framebuffer; blocks while queueSize frames are waiting
+    TGAImage* acquire(int width, int height, int bytespp);
+    // queues a framebuffer from acquire() to be written to filename ("-"
+    // for stdout) in format; no flip is needed
+    void submit(TGAImage* image, const std::string& filename, ImageFormat format);
+    // waits until every queued frame is written; false if a write failed
+    bool finish();
+
+private:
+    struct Job
+    {
+        TGAImage* image;
+        std::string filename;
+        ImageFormat format;
+    };
+
+    void run();
+
+    int queueSize;
+    int encodeThreads;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<Job> queue;
+    std::vector<TGAImage*> spare;   // written, ready to be acquired again
+    std::vector<TGAImage*> images;  // every framebuffer, for the destructor
+    bool writing;
+    bool failed;
+    bool stopping;
+    std::thread thread;
+};
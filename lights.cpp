@@ -0,0 +1,196 @@
+#include <algorithm>
+#include <cmath>
+#include "lights.h"
+
+Vec3f illuminate(const Light& light, Vec3f position, Vec3f normal)
+{
+    Vec3f toLight = light.position - position;
+    float squared = toLight * toLight;
+    if (squared >= light.radius * light.radius || squared <= 0) return Vec3f(0, 0, 0);
+    float distance = std::sqrt(squared);
+    Vec3f l = toLight * (1 / distance);
+    float lambert = normal * l;
+    if (lambert <= 0) return Vec3f(0, 0, 0);
+
+    float falloff = 1 - distance / light.radius;
+    falloff *= falloff;
+    if (light.cosOuter > -1)
+    {
+        float cosine = -(l * light.direction);
+        if (cosine <= light.cosOuter) return Vec3f(0, 0, 0);
+        float t = std::min(1.f, (cosine - light.cosOuter) / std::max(light.cosInner - light.cosOuter, 1e-6f));
+        falloff *= t * t * (3 - 2 * t);
+    }
+    return light.color * (lambert * falloff);
+}
+
+std::vector<Light> scatterLights(int count, Vec3f center, float radius, unsigned seed)
+{
+    // a linear congruential generator, so that every platform gets the same lights
+    unsigned state = seed;
+    auto uniform = [&state]() {
+        state = state * 1664525u + 1013904223u;
+        return (state >> 8) * (1.f / (1 << 24));
+    };
+    std::vector<Light> lights;
+    for (int i = 0; i < count; i++)
+    {
+        Vec3f offset;
+        do offset = Vec3f(uniform() * 2 - 1, uniform() * 2 - 1, uniform() * 2 - 1);
+        while (offset * offset > 1);
+        Vec3f position = center + offset * radius;
+        float reach = radius * (.25f + uniform() * .25f);
+        Vec3f color = Vec3f(uniform(), uniform(), uniform()) * 1.5f;
+        Vec3f direction = center - position;
+        if (direction.norm() > 0) direction.normalize();
+        Light light = {position, reach, color, direction, i % 3 ? -1.f : .7f, i % 3 ? -1.f : .9f};
+        lights.push_back(light);
+    }
+    return lights;
+}
+
+LightGrid::LightGrid() : lights_(), tilesX(0), tilesY(0), offsets(1, 0), indices(), lit(0)
+{
+}
+
+// the screen rectangle and the range of stored depths the sphere of light
+// may reach, from the corners of its bounding box; false when it is behind
+// the camera
+static bool screenBounds(const Light& light, const Matrix& toScreen, float* low, float* high)
+{
+    low[0] = low[1] = low[2] = std::numeric_limits<float>::max();
+    high[0] = high[1] = high[2] = -std::numeric_limits<float>::max();
+    int behind = 0;
+    for (int c = 0; c < 8; c++)
+    {
+        Vec3f corner = light.position + Vec3f(c & 1 ? light.radius : -light.radius, c & 2 ? light.radius : -light.radius,
+                                              c & 4 ? light.radius : -light.radius);
+        Vec4f p = toScreen * embed<4>(corner);
+        // the view looks down -z, so points in front of the camera have w < 0
+        if (p[3] >= 0)
+        {
+            behind++;
+            continue;
+        }
+        for (int i = 0; i < 3; i++)
+        {
+            low[i] = std::min(low[i], p[i] / p[3]);
+            high[i] = std::max(high[i], p[i] / p[3]);
+        }
+    }
+    if (behind == 8) return false;
+    if (behind)
+    {
+        // around the camera plane: anywhere on screen and at any depth
+        low[0] = low[1] = low[2] = -std::numeric_limits<float>::max();
+        high[0] = high[1] = high[2] = std::numeric_limits<float>::max();
+    }
+    return true;
+}
+
+void LightGrid::build(const std::vector<Light>& lights, zbuffer& zbuffer)
+{
+    lights_ = lights;
+    int width = zbuffer.size[0], height = zbuffer.size[1];
+    tilesX = (width + LIGHT_TILE - 1) / LIGHT_TILE;
+    tilesY = (height + LIGHT_TILE - 1) / LIGHT_TILE;
+    int ntiles = tilesX * tilesY;
+
+    // the range of depths drawn in every tile, empty where nothing was; a
+    // cleared unorm depth reads as the far plane
+    std::vector<float> depths((size_t)width * height);
+    zbuffer.read(depths.data());
+    float cleared = zbuffer.format == DEPTH_FLOAT32 ? -std::numeric_limits<float>::max() : -1.f;
+    std::vector<float> nearest(ntiles, -std::numeric_limits<float>::max());
+    std::vector<float> farthest(ntiles, std::numeric_limits<float>::max());
+    for (int y = 0; y < height; y++)
+    {
+        const float* row = &depths[(size_t)y * width];
+        for (int x = 0; x < width; x++)
+        {
+            if (row[x] == cleared) continue;
+            int t = x / LIGHT_TILE + y / LIGHT_TILE * tilesX;
+            nearest[t] = std::max(nearest[t], row[x]);
+            farthest[t] = std::min(farthest[t], row[x]);
+        }
+    }
+
+    // counted first, then filled, so that every tile's list is contiguous
+    Matrix toScreen = uniforms.screen * Perspective * CameraView;
+    std::vector<int> rects(lights.size() * 4, 0);
+    std::vector<float> ranges(lights.size() * 2, 0);
+    std::vector<int> counts(ntiles + 1, 0);
+    for (size_t i = 0; i < lights.size(); i++)
+    {
+        float low[3], high[3];
+        int* rect = &rects[i * 4];
+        rect[0] = rect[1] = 0;
+        rect[2] = rect[3] = -1;
+        if (!screenBounds(lights[i], toScreen, low, high) || high[0] < 0 || high[1] < 0 || low[0] >= width || low[1] >= height)
+            continue;
+        rect[0] = (int)std::max(0.f, std::floor(low[0])) / LIGHT_TILE;
+        rect[1] = (int)std::max(0.f, std::floor(low[1])) / LIGHT_TILE;
+        rect[2] = (int)std::min((float)width - 1, high[0]) / LIGHT_TILE;
+        rect[3] = (int)std::min((float)height - 1, high[1]) / LIGHT_TILE;
+        ranges[i * 2] = low[2];
+        ranges[i * 2 + 1] = high[2];
+        for (int ty = rect[1]; ty <= rect[3]; ty++)
+            for (int tx = rect[0]; tx <= rect[2]; tx++)
+            {
+                int t = tx + ty * tilesX;
+                counts[t] += low[2] <= nearest[t] && high[2] >= farthest[t];
+            }
+    }
+    offsets.assign(ntiles + 1, 0);
+    lit = 0;
+    for (int t = 0; t < ntiles; t++)
+    {
+        offsets[t + 1] = offsets[t] + counts[t];
+        lit += counts[t] > 0;
+    }
+    indices.resize(offsets[ntiles]);
+    std::vector<int> next(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < lights.size(); i++)
+    {
+        const int* rect = &rects[i * 4];
+        for (int ty = rect[1]; ty <= rect[3]; ty++)
+            for (int tx = rect[0]; tx <= rect[2]; tx++)
+            {
+                int t = tx + ty * tilesX;
+                if (ranges[i * 2] <= nearest[t] && ranges[i * 2 + 1] >= farthest[t]) indices[next[t]++] = (int)i;
+            }
+    }
+}
+
+const int* LightGrid::tileLights(int x, int y, int& count) const
+{
+    int tx = x / LIGHT_TILE, ty = y / LIGHT_TILE;
+    if (x < 0 || y < 0 || tx >= tilesX || ty >= tilesY)
+    {
+        count = 0;
+        return NULL;
+    }
+    int t = tx + ty * tilesX;
+    count = offsets[t + 1] - offsets[t];
+    return indices.data() + offsets[t];
+}
+
+const std::vector<Light>& LightGrid::lights() const
+{
+    return lights_;
+}
+
+long long LightGrid::binned() const
+{
+    return offsets.back();
+}
+
+int LightGrid::litTiles() const
+{
+    return lit;
+}
+
+int LightGrid::ntiles() const
+{
+    return tilesX * tilesY;
+}
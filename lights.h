@@ -0,0 +1,62 @@
+#pragma once
+
+#include <vector>
+#include "geometry.h"
+#include "our_gl.h"
+
+// A local light, in the space of the shading normals (after ModelView). It
+// fades to nothing at radius, so nothing past it needs to evaluate it. A
+// spot light lights the cone around direction, fully within cosInner and
+// fading out to cosOuter; a point light has cosOuter of -1.
+struct Light
+{
+    Vec3f position;
+    float radius;
+    Vec3f color;        // red, green and blue intensity
+    Vec3f direction;    // unit, away from the light
+    float cosOuter;
+    float cosInner;
+};
+
+// the red, green and blue light falling from light on a point at position
+// with unit normal normal
+Vec3f illuminate(const Light& light, Vec3f position, Vec3f normal);
+
+// count lights, a third of them spots aimed at center, scattered over a
+// sphere of radius around it with radii of a quarter to a half of radius;
+// the same seed gives the same lights
+std::vector<Light> scatterLights(int count, Vec3f center, float radius, unsigned seed = 1);
+
+const int LIGHT_TILE = 16;
+
+// Tiled light culling. Once the depth of a frame is drawn, build() gives
+// every LIGHT_TILE square of pixels the lights whose sphere reaches the range
+// of depths stored in it, so that a fragment shaded afterwards evaluates
+// those rather than every light; tiles nothing was drawn into get none.
+class LightGrid
+{
+public:
+    LightGrid();
+
+    // bins lights for the current view (CameraView, Perspective and the
+    // uniforms) over zbuffer, which must hold the depth of the frame
+    void build(const std::vector<Light>& lights, zbuffer& zbuffer);
+
+    // the lights that may reach pixel x, y of the view: indices into
+    // lights(), count of them
+    const int* tileLights(int x, int y, int& count) const;
+    const std::vector<Light>& lights() const;
+
+    // lights binned, summed over the tiles that got any, and those tiles
+    long long binned() const;
+    int litTiles() const;
+    int ntiles() const;
+
+private:
+    std::vector<Light> lights_;
+    int tilesX;
+    int tilesY;
+    std::vector<int> offsets;   // per tile into indices, and one past the last
+    std::vector<int> indices;
+    int lit;
+};
@@ -1,9 +1,22 @@
 #include <vector>
+#include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+#include <string>
+#include <thread>
 #include "tgaimage.h"
 #include "model.h"
 #include "geometry.h"
 #include "our_gl.h"
+#include "bench.h"
+#include "render.h"
+#include "trace.h"
+#include "imagewriter.h"
+#include "tiles.h"
+#include "reproject.h"
+#include "rendertarget.h"
 
 float* depthBuffer = NULL;
 
@@ -14,98 +27,21 @@ Matrix Viewport = Matrix::identity();
 Matrix Perspective = Matrix::identity();
 Matrix NDCView = Matrix::identity();
 Matrix Orthographic = Matrix::identity();
+Uniforms uniforms;
 
 const TGAColor white = TGAColor(255, 255, 255, 255);
 const TGAColor red = TGAColor(255, 0, 0, 255);
 const TGAColor block = TGAColor(0, 0, 0, 255);
 
 Model* model = NULL;
-const int width = 800;
-const int height = 800;
+int width = 800;
+int height = 800;
+DepthFormat depthFormat = DEPTH_FLOAT32;
+int drawRate = 1; // shading rate of every draw, or SHADING_RATE_AUTO
 
 Vec3f lightDir(0, 0, -1);
-
-struct GouraudShader : IShader
-{
-    Vec3f vertex_normal[3];
-    Vec3f vertex_pos[3];
-    Vec2f uv[3];
-
-    virtual Vec4f vertex(int iface, int nthvert)
-    {
-        uv[nthvert] = model->uv(iface, nthvert);
-        vertex_normal[nthvert] = model->normal(iface, nthvert);
-        vertex_pos[nthvert] = model->vert(iface, nthvert);
-
-        Vec4f ver = embed<4>(model->vert(iface, nthvert));
-
-        ver = Viewport * NDCView * Perspective * CameraView * ModelView * ver;
-        float temp = ver[3];
-        ver = ver / ver[3];
-        ver[3] = temp;
-        return ver;
-    }
-
-    virtual bool fragment(Vec3f barycentricCoord, TGAColor& color)
-    {
-        float zn = 1 / (barycentricCoord[0] + barycentricCoord[1] + barycentricCoord[2]);
-        float light;
-
-        Vec2f bar_uv = (uv[0] * barycentricCoord.x + uv[1] * barycentricCoord.y + uv[2] * barycentricCoord.z) * zn;
-        Vec3f bar_normal = proj<3>(ModelView * embed<4>((vertex_normal[0] * barycentricCoord.x + vertex_normal[1] * barycentricCoord.y + vertex_normal[2] * barycentricCoord.z) * zn));
-        bar_normal.normalize();
-
-        Vec2f delta_vu1 = uv[2] - uv[0];
-        Vec2f delta_vu2 = uv[1] - uv[0];
-        Vec3f E1 = vertex_pos[2] - vertex_pos[0];
-        Vec3f E2 = vertex_pos[1] - vertex_pos[0];
-
-        Vec3f T = (E2 * delta_vu1[0] - E1 * delta_vu2[0]) / (delta_vu1[0] * delta_vu2[1] - delta_vu2[0] * delta_vu1[1]);
-        T.normalize();
-
-        T = (T - bar_normal * (T * bar_normal)).normalize();
-        Vec3f B = cross(bar_normal, T).normalize();
-        mat<3, 3, float> TBN;
-        TBN[0] = T;
-        TBN[1] = B;
-        TBN[2] = bar_normal;
-
-        Vec3f normal_tangent = TBN * model->normal(bar_uv);
-        light = std::max(0.f, normal_tangent * (lightDir * -1));
-
-        color = model->diffuse(bar_uv) * light;
-        return true;
-    }
-
-};
-
-struct flootShader : IShader
-{
-    Vec2f uv[3];
-
-    virtual Vec4f vertex(int iface, int nthvert)
-    {
-        uv[nthvert] = model->uv(iface, nthvert);
-        Vec4f ver = embed<4>(model->vert(iface, nthvert));
-
-        ver = Perspective * CameraView * ModelView * ver;
-        float temp = ver[3];
-        ver = ver / ver[3];
-        ver[2] = temp;
-        ver = NDCView * ver;
-        ver = Viewport * ver;
-        ver[3] = temp;
-        return ver;
-    }
-
-    virtual bool fragment(Vec3f barycentricCoord, TGAColor& color)
-    {
-        float zn = 1 / (barycentricCoord[0] + barycentricCoord[1] + barycentricCoord[2]);
-        Vec2f bar_uv = (uv[0] * barycentricCoord.x + uv[1] * barycentricCoord.y + uv[2] * barycentricCoord.z) * zn;
-        color = model->diffuse(bar_uv);
-        return true;
-    }
-};
+// scratch framebuffers; frames that get written come from the ImageWriter
+RenderTargetPool targets;
 
 struct triangle_s
 {
@@ -177,14 +113,230 @@ void drawLine(const triangle_s& tri, const TGAColor& color, TGAImage& image)
     }
 }
 
-int main(int argc, char** argv) {
-    if (2 == argc) {
-        model = new Model(argv[1]);
+// rasterizes every face of the full resolution mesh without depth test or
+// culling; on a closed mesh the front and back faces over each pixel must
+// cancel out exactly, so any pixel left with a nonzero winding was missed or
+// hit twice along a shared edge
+int checkWatertight(IShader& shader)
+{
+    std::vector<int> counts(width * height, 0);
+    long covered = 0;
+    Vec4f vertex[3];
+    for (int i = 0; i < model->nfaces(); i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            vertex[j] = shader.vertex(i, j);
+        }
+        covered += windingCount(vertex, width, height, counts);
+    }
+
+    int leaks = 0;
+    for (int i = 0; i < width * height; i++) leaks += counts[i] != 0;
+    std::cerr << "# watertight " << (leaks ? "failed" : "ok") << ": " << covered << " pixel hits, "
+              << leaks << " pixels with nonzero winding" << std::endl;
+    return leaks ? 1 : 0;
+}
+
+// the file of frame f: a batch of frames to a file gets the frame number
+// before the extension, a batch to stdout ("-") is one stream
+std::string frameFilename(const std::string& output, int f, int frames)
+{
+    if (frames == 1 || output == "-") return output;
+    size_t dot = output.find_last_of('.');
+    if (dot == std::string::npos) dot = output.size();
+    char number[16];
+    snprintf(number, sizeof(number), "%04d", f);
+    return output.substr(0, dot) + number + output.substr(dot);
+}
+
+// renders bandRows rows at a time into band sized targets and streams every
+// finished band to the file, bottom band first, so that memory depends on the
+// band and not on the image size
+int renderBands(IShader& shader, int bandRows, bool msaa, const char* filename)
+{
+    TGAStream out;
+    if (!out.open(filename, width, height, TGAImage::RGB)) return 1;
+
+    int rows = std::min(bandRows, height);
+    TGAImage band(width, rows, TGAImage::RGB);
+    zbuffer zbuffer(width, rows, depthFormat);
+    MsaaTarget* target = msaa ? new MsaaTarget(width, rows, TGAImage::RGB) : NULL;
+    bool ok = true;
+    for (int y0 = 0; ok && y0 < height; y0 += rows)
+    {
+        int y1 = std::min(y0 + rows, height);
+        band.clear();
+        zbuffer.clear();
+        if (target) target->clear();
+
+        viewportBand(width, height, y0, y1);
+        setUniforms(lightDir);
+        drawModel(shader, band, zbuffer, target, false, drawRate);
+        if (target) target->resolve(band);
+
+        TRACE_SCOPE("write band");
+        ok = out.write_rows(band, y1 - y0);
+    }
+    delete target;
+    return out.close() && ok ? 0 : 1;
+}
+
+// draws the model and a smaller copy behind it that moves a little every
+// frame; after the first frame only the tiles the copy leaves or enters
+// are drawn again
+int renderIncremental(IShader& shader, int frames, const std::string& output, ImageFormat format)
+{
+    Instance head = { model, &shader, Vec3f(0, 0, 0), Vec3f(0, 0, 0) };
+    Instance moving = { model, &shader, Vec3f(1.5f, 1.f, -3.f), Vec3f(0, 0, 0) };
+    std::vector<Instance> instances;
+    instances.push_back(head);
+    instances.push_back(moving);
+    std::vector<int> moved(1, 1);
+
+    ImageWriter writer(2, std::max(1u, std::thread::hardware_concurrency()));
+    TileCache cache(width, height, lightDir);
+    TGAImage image(width, height, TGAImage::RGB);
+    zbuffer zbuffer(width, height, depthFormat);
+    for (int f = 0; f < frames; f++)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        int drawn = cache.ntiles();
+        if (f == 0) cache.render(instances, image, zbuffer);
+        else
+        {
+            instances[1].location.x -= .05f;
+            drawn = cache.update(instances, moved, image, zbuffer);
+        }
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::cerr << "# frame " << f << " tiles " << drawn << "/" << cache.ntiles() << " render " << elapsed.count() << " ms" << std::endl;
+
+        TGAImage* frame = writer.acquire(width, height, TGAImage::RGB);
+        memcpy(frame->buffer(), image.buffer(), (size_t)width * height * TGAImage::RGB);
+        writer.submit(frame, frameFilename(output, f, frames), format);
     }
-    else {
-        model = new Model("obj/african_head/african_head.obj");
+    return writer.finish() ? 0 : 1;
+}
+
+// draws the frame again without reusing pixels, the way it was drawn (lit
+// by lights when there are any, with the depth pre-pass when it had one),
+// and prints how much shading the reprojection saved and how far its image
+// is from the reference
+void reportReprojection(GouraudShader& shader, TGAImage& image, zbuffer& zbuffer, long long shaded, long long reused,
+                        const std::vector<Light>& lights, LightGrid& grid, bool prepass)
+{
+    TGAImage& reference = *targets.acquireColor(image.get_width(), image.get_height(), image.get_bytespp());
+    long long full;
+    {
+        // the reference is not part of the frame's statistics
+        StatsPause pause;
+        zbuffer.clear();
+        if (lights.empty()) drawModel(shader, reference, zbuffer, NULL, prepass, drawRate);
+        else drawModelLit(shader, reference, zbuffer, lights, grid, drawRate);
+        full = pause.counted().pixelsShaded;
     }
 
+    int differing;
+    double error = psnr(reference, image, differing);
+    targets.release(&reference);
+    std::cerr << "# reproject reused " << reused << " shaded " << shaded << "/" << full
+              << " (" << (full ? 100. * (full - shaded) / full : 0.) << "% saved) psnr " << error << " dB, "
+              << differing << " pixels differ" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    const char* filename = "obj/african_head/african_head.obj";
+    traceFromEnvironment();
+    int flags = 0;
+    float distance = 4;
+    bool msaa = false;
+    bool ssaa = false;
+    bool watertight = false;
+    bool stats = false;
+    bool statsJson = false;
+    bool reproject = false;
+    bool prepass = false;
+    bool prepassAuto = false;
+    int bandRows = 0;
+    int nlights = 0;
+    int frames = 1;
+    int incremental = 0;
+    std::string output = "output.tga";
+    const char* format = NULL;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--bench-geometry")) return benchGeometry(10000000);
+        else if (!strcmp(argv[i], "--bench")) // [obj dir [hash file [repeat]]] [--record-hashes]
+        {
+            std::vector<const char*> args;
+            bool recordHashes = false;
+            for (int j = i + 1; j < argc; j++)
+            {
+                if (!strcmp(argv[j], "--record-hashes")) recordHashes = true;
+                else args.push_back(argv[j]);
+            }
+            int ret = benchScenes(args.size() > 0 ? args[0] : "tinyRender/obj", args.size() > 1 ? args[1] : "bench_hashes.txt",
+                                  args.size() > 2 ? atoi(args[2]) : 5, recordHashes);
+            traceStop();
+            return ret;
+        }
+        else if (!strcmp(argv[i], "--trace") && i + 1 < argc) traceStart(argv[++i]); // or TINYRENDER_TRACE=file
+        else if (!strcmp(argv[i], "--optimize")) flags |= Model::OPTIMIZE;
+        else if (!strcmp(argv[i], "--lod")) flags |= Model::LODS;
+        else if (!strcmp(argv[i], "--compress-textures")) flags |= Model::COMPRESS_TEXTURES;
+        else if (!strcmp(argv[i], "--quantize")) flags |= Model::QUANTIZE; // 16 bit vertex attributes
+        else if (!strcmp(argv[i], "--texture-budget") && i + 1 < argc) textureCache.setBudget((size_t)atoi(argv[++i]) << 20); // MB of maps kept loaded
+        else if (!strcmp(argv[i], "--depth") && i + 1 < argc) // bits per depth, 16, 24 or 32 (float)
+        {
+            const char* bits = argv[++i];
+            if (!strcmp(bits, "16")) depthFormat = DEPTH_UNORM16;
+            else if (!strcmp(bits, "24")) depthFormat = DEPTH_UNORM24;
+            else if (!strcmp(bits, "32")) depthFormat = DEPTH_FLOAT32;
+            else
+            {
+                std::cerr << "unknown depth format " << bits << ", expected 16, 24 or 32" << std::endl;
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--shading-rate") && i + 1 < argc) // 1, 2, 4 or auto, pixels per shaded block side
+        {
+            const char* rate = argv[++i];
+            if (!strcmp(rate, "auto")) drawRate = SHADING_RATE_AUTO;
+            else if (!strcmp(rate, "1") || !strcmp(rate, "2") || !strcmp(rate, "4")) drawRate = atoi(rate);
+            else
+            {
+                std::cerr << "unknown shading rate " << rate << ", expected 1, 2, 4 or auto" << std::endl;
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--lights") && i + 1 < argc) nlights = atoi(argv[++i]); // local lights, binned per tile
+        else if (!strcmp(argv[i], "--distance") && i + 1 < argc) distance = (float)atof(argv[++i]);
+        else if (!strcmp(argv[i], "--msaa")) msaa = true;
+        else if (!strcmp(argv[i], "--watertight")) watertight = true;
+        else if (!strcmp(argv[i], "--stats")) stats = true;
+        else if (!strcmp(argv[i], "--stats-json")) statsJson = true;
+        else if (!strcmp(argv[i], "--size") && i + 1 < argc) width = height = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--frames") && i + 1 < argc) frames = std::max(1, atoi(argv[++i])); // turntable, output%04d.tga
+        else if (!strcmp(argv[i], "--prepass")) prepass = true; // depth only pass first
+        else if (!strcmp(argv[i], "--prepass-auto")) prepassAuto = true; // per frame, when the overdraw makes it pay
+        else if (!strcmp(argv[i], "--reproject")) reproject = true; // turntable orbits the camera and reuses shading
+        else if (!strcmp(argv[i], "--output") && i + 1 < argc) output = argv[++i]; // "-" for stdout
+        else if (!strcmp(argv[i], "--format") && i + 1 < argc) // tga, ppm, pam or png
+        {
+            format = argv[++i];
+            if (!isImageFormat(format))
+            {
+                std::cerr << "unknown image format " << format << ", expected tga, ppm, pam or png" << std::endl;
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--incremental") && i + 1 < argc) incremental = atoi(argv[++i]); // frames with one moving copy
+        else if (!strcmp(argv[i], "--band") && i + 1 < argc) bandRows = atoi(argv[++i]); // rows per streamed band
+        else if (!strcmp(argv[i], "--ssaa")) ssaa = true; // 2x2 supersampling through TGAImage::scale, for comparison
+        else filename = argv[i];
+    }
+    model = new Model(filename, flags);
+
     // draw line
     /*for (int i = 0; i < model->nfaces(); i++) {
         std::vector<int> face = model->face(i);
@@ -195,34 +347,149 @@ int main(int argc, char** argv) {
         drawLine(tri, white, image);
     }*/
 
-
-    TGAImage image(width, height, TGAImage::RGB);
-    TGAImage ShaderBuffer(width, height, TGAImage::RGB);
-    zbuffer zbuffer(width, height);
+    int scale = ssaa ? 2 : 1;
     GouraudShader shader;
     lightDir.normalize();
-    Vec4f vertex[3];
 
-    zbuffer.clear();
     modelView(Vec3f(0, 0, 0), Vec3f(0, 0, 0));
-    cameraView(Vec3f(0, 0, 4), Vec3f(0, 180, 0));
+    cameraView(Vec3f(0, 0, distance), Vec3f(0, 180, 0));
     perspective(-1, -10.f, 45, 1);
     ndcView(-1, -10.f, 45, 1);
-    viewport(width, height);
+    viewport(width * scale, height * scale);
+    setUniforms(lightDir);
 
-    for (int i = 0; i < model->nfaces(); i++)
+    ImageFormat outputFormat = imageFormat(format ? format : output == "-" ? "ppm" : output);
+    if (bandRows > 0 && (outputFormat != FORMAT_TGA || output == "-"))
     {
-        std::vector<int> face = model->face(i);
-        for (int j = 0; j < 3; j++)
+        std::cerr << "banded output is only written to tga files" << std::endl;
+        delete model;
+        return 1;
+    }
+
+    if (reproject && (msaa || ssaa))
+    {
+        std::cerr << "reprojection works on single sampled frames only" << std::endl;
+        delete model;
+        return 1;
+    }
+
+    if (incremental > 0)
+    {
+        int ret = renderIncremental(shader, incremental, output, outputFormat);
+        traceStop();
+        delete model;
+        return ret;
+    }
+
+    if (watertight || bandRows > 0)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        int ret = watertight ? checkWatertight(shader) : renderBands(shader, bandRows, msaa, output.c_str());
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        if (!watertight) std::cerr << "# render and write " << elapsed.count() << " ms" << std::endl;
+        traceStop();
+        delete model;
+        return ret;
+    }
+
+    // frames are written in the background while the next one renders
+    ImageWriter writer(2, std::max(1u, std::thread::hardware_concurrency()));
+    zbuffer zbuffer(width * scale, height * scale, depthFormat);
+    MsaaTarget* target = msaa ? new MsaaTarget(width, height, TGAImage::RGB) : NULL;
+    ReprojectionCache* reprojection = reproject ? new ReprojectionCache(width, height, TGAImage::RGB) : NULL;
+    PrepassHeuristic heuristic;
+    // the lights stay where they are while a turntable turns the model
+    std::vector<Light> lights = scatterLights(nlights, model->center(), model->radius() * 1.2f);
+    LightGrid grid;
+    std::vector<PipelineStats> frameStats;
+    // with --ssaa frames are drawn here, then scaled into one from the writer
+    TGAImage supersampled;
+    if (ssaa) supersampled = TGAImage(width * scale, height * scale, TGAImage::RGB);
+    if (nlights && msaa) std::cerr << "# lights are not drawn with --msaa" << std::endl;
+    for (int f = 0; f < frames; f++)
+    {
+        if (frames > 1)
         {
-            vertex[j] = shader.vertex(i, j);
+            float angle = 360.f * f / frames;
+            if (reprojection)
+            {
+                // moving the camera rather than the model keeps the light
+                // where it was, so that shaded pixels stay valid
+                float radians = angle * 3.14159f / 180;
+                cameraView(Vec3f(distance * std::sin(radians), 0, distance * std::cos(radians)), Vec3f(0, 180 + angle, 0));
+            }
+            else modelView(Vec3f(0, 0, 0), Vec3f(0, angle, 0));
+            setUniforms(lightDir);
         }
-        triangle(vertex, shader, image, zbuffer);
+        TGAImage* image = ssaa ? &supersampled : writer.acquire(width, height, TGAImage::RGB);
+        if (ssaa) image->clear();
+        zbuffer.clear();
+        if (target) target->clear();
+
+        PipelineStats before = threadStats;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (reprojection) reprojection->begin();
+        DrawInfo info = nlights && !target ? drawModelLit(shader, *image, zbuffer, lights, grid, drawRate)
+                                           : drawModel(shader, *image, zbuffer, target, prepassAuto ? heuristic.choose() : prepass, drawRate);
+        if (reprojection) reprojection->store(*image, zbuffer);
+        if (target) target->resolve(*image);
+        if (ssaa)
+        {
+            image = writer.acquire(width, height, TGAImage::RGB);
+            supersampled.scale(*image);
+        }
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::cerr << "# lod " << info.lod << " meshlets culled " << info.culledMeshlets << "/" << info.meshlets
+                  << " f# culled " << info.culledFaces << "/" << info.faces;
+        if (model->nmaterials() > 1) std::cerr << " material binds " << info.materialBinds;
+        if (drawRate != 1) std::cerr << " coarse meshlets " << info.coarseMeshlets;
+        std::cerr << std::endl;
+        std::cerr << "# render " << elapsed.count() << " ms" << std::endl;
+        if (nlights && !target)
+        {
+            std::cerr << "# lights " << nlights << ", " << (grid.litTiles() ? (double)grid.binned() / grid.litTiles() : 0.)
+                      << " per lit tile, " << grid.litTiles() << "/" << grid.ntiles() << " tiles lit" << std::endl;
+        }
+        heuristic.update(info, before, threadStats);
+        if (info.prepass)
+        {
+            std::cerr << "# prepass overdraw " << heuristic.overdraw();
+            if (prepassAuto) std::cerr << (heuristic.choose() ? ", pays" : ", does not pay");
+            std::cerr << std::endl;
+        }
+        if (reprojection)
+        {
+            reportReprojection(shader, *image, zbuffer, threadStats.pixelsShaded - before.pixelsShaded,
+                               threadStats.pixelsReused - before.pixelsReused, lights, grid, info.prepass);
+        }
+
+        writer.submit(image, frameFilename(output, f, frames), outputFormat);
+
+        // the counters are merged and reset at the end of every frame
+        PipelineStats frame;
+        mergeThreadStats(frame);
+        if (stats)
+        {
+            if (frames > 1) fprintf(stderr, "# frame %d\n", f);
+            frame.writeTable(stderr);
+        }
+        if (statsJson) frameStats.push_back(frame);
     }
 
+    int ret = writer.finish() ? 0 : 1;
 
-    image.flip_vertically(); // i want to have the origin at the left bottom corner of the image
-    image.write_tga_file("output.tga");
+    // one line per frame, after the last frame is written and never into
+    // a stream of frames on stdout
+    FILE* json = output == "-" ? stderr : stdout;
+    for (size_t f = 0; f < frameStats.size(); f++)
+    {
+        fprintf(json, "{\"frame\": %d, \"stats\": ", (int)f);
+        frameStats[f].writeJson(json);
+        fprintf(json, "}\n");
+    }
+    traceStop();
+    delete reprojection;
+    delete target;
     delete model;
-    return 0;
+    return ret;
 }
@@ -0,0 +1,705 @@
+#include <algorithm>
+#include <limits>
+#include "meshopt.h"
+
+static const float CONE_WEIGHT = 1.f; // cost of a face at right angles to the cone, in new vertices
+
+// vertex -> faces adjacency in compressed form: the faces around vertex v are
+// faces[offsets[v]] .. faces[offsets[v+1]-1]
+struct Adjacency
+{
+    Adjacency() : offsets(), faces() {}
+
+    std::vector<int> offsets;
+    std::vector<int> faces;
+};
+
+static void buildAdjacency(int nverts, const std::vector<int>& indices, Adjacency& adj)
+{
+    int nfaces = (int)indices.size() / 3;
+
+    adj.offsets.assign(nverts + 1, 0);
+    for (size_t i = 0; i < indices.size(); i++) adj.offsets[indices[i] + 1]++;
+    for (int v = 0; v < nverts; v++) adj.offsets[v + 1] += adj.offsets[v];
+
+    std::vector<int> fill(adj.offsets.begin(), adj.offsets.end() - 1);
+    adj.faces.resize(indices.size());
+    for (int f = 0; f < nfaces; f++)
+        for (int j = 0; j < 3; j++)
+            adj.faces[fill[indices[f * 3 + j]]++] = f;
+}
+
+static void computeMeshletBounds(const std::vector<Vec3f>& verts, const std::vector<int>& indices,
+                                 const int* faces, Meshlet& meshlet)
+{
+    Vec3f bmin = verts[indices[faces[0] * 3]];
+    Vec3f bmax = bmin;
+    for (int k = 0; k < meshlet.nfaces; k++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            Vec3f p = verts[indices[faces[k] * 3 + j]];
+            for (int i = 0; i < 3; i++)
+            {
+                bmin[i] = std::min(bmin[i], p[i]);
+                bmax[i] = std::max(bmax[i], p[i]);
+            }
+        }
+    }
+
+    meshlet.center = (bmin + bmax) * 0.5f;
+    meshlet.radius = 0;
+    for (int k = 0; k < meshlet.nfaces; k++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            Vec3f d = verts[indices[faces[k] * 3 + j]] - meshlet.center;
+            meshlet.radius = std::max(meshlet.radius, d.norm());
+        }
+    }
+
+    // the normal cone: the axis is the mean face normal, the half angle the
+    // widest deviation from it
+    std::vector<Vec3f> normals;
+    Vec3f axis(0, 0, 0);
+    for (int k = 0; k < meshlet.nfaces; k++)
+    {
+        const int* f = &indices[faces[k] * 3];
+        Vec3f n = cross(verts[f[1]] - verts[f[0]], verts[f[2]] - verts[f[0]]);
+        float area = n.norm();
+        if (area <= 0) continue; // degenerate faces never show up on screen
+        n = n / area;
+        normals.push_back(n);
+        axis = axis + n;
+    }
+
+    meshlet.coneAxis = Vec3f(0, 0, 1);
+    meshlet.coneCutoff = 1;
+    float len = axis.norm();
+    if (normals.empty() || len <= 0) return;
+    meshlet.coneAxis = axis / len;
+
+    float mindp = 1;
+    for (size_t i = 0; i < normals.size(); i++) mindp = std::min(mindp, normals[i] * meshlet.coneAxis);
+
+    // a cone close to a hemisphere would hardly ever cull anything
+    if (mindp <= 0.1f) return;
+
+    // the set of back facing view directions is the normal cone widened by 90
+    // degrees and inverted: -cos(a+90) = sin(a)
+    meshlet.coneCutoff = std::sqrt(1 - mindp * mindp);
+}
+
+void buildMeshlets(const std::vector<Vec3f>& verts, const std::vector<int>& indices,
+                   std::vector<Meshlet>& meshlets, std::vector<int>& meshletFaces)
+{
+    int nfaces = (int)indices.size() / 3;
+    int nverts = (int)verts.size();
+
+    meshlets.clear();
+    meshletFaces.clear();
+    meshletFaces.reserve(nfaces);
+
+    Adjacency adj;
+    buildAdjacency(nverts, indices, adj);
+
+    std::vector<Vec3f> faceNormals(nfaces);
+    for (int f = 0; f < nfaces; f++)
+    {
+        const int* v = &indices[f * 3];
+        Vec3f n = cross(verts[v[1]] - verts[v[0]], verts[v[2]] - verts[v[0]]);
+        float area = n.norm();
+        faceNormals[f] = area > 0 ? n / area : n;
+    }
+
+    std::vector<bool> emitted(nfaces, false);
+    std::vector<int> stamp(nverts, -1); // meshlet that already holds the vertex
+    std::vector<int> candidates;
+
+    int seed = 0;
+    while (true)
+    {
+        while (seed < nfaces && emitted[seed]) seed++;
+        if (seed == nfaces) break;
+
+        Meshlet meshlet;
+        meshlet.firstFace = (int)meshletFaces.size();
+        meshlet.nfaces = 0;
+        meshlet.nverts = 0;
+        int id = (int)meshlets.size();
+
+        candidates.clear();
+        Vec3f coneSum(0, 0, 0);
+        int face = seed;
+
+        // grow the meshlet greedily over its neighbours, always taking the
+        // face that brings in the fewest new vertices and bends the cone least
+        while (face >= 0)
+        {
+            emitted[face] = true;
+            meshletFaces.push_back(face);
+            coneSum = coneSum + faceNormals[face];
+            meshlet.nfaces++;
+
+            for (int j = 0; j < 3; j++)
+            {
+                int v = indices[face * 3 + j];
+                if (stamp[v] == id) continue;
+                stamp[v] = id;
+                meshlet.nverts++;
+                for (int a = adj.offsets[v]; a < adj.offsets[v + 1]; a++)
+                {
+                    if (!emitted[adj.faces[a]]) candidates.push_back(adj.faces[a]);
+                }
+            }
+
+            face = -1;
+            if (meshlet.nfaces == MESHLET_MAX_FACES) break;
+
+            Vec3f axis = coneSum;
+            float len = axis.norm();
+            if (len > 0) axis = axis / len;
+
+            float best = std::numeric_limits<float>::max();
+            size_t live = 0;
+            for (size_t c = 0; c < candidates.size(); c++)
+            {
+                int f = candidates[c];
+                if (emitted[f]) continue;
+                candidates[live++] = f;
+
+                int added = 0;
+                for (int j = 0; j < 3; j++) added += stamp[indices[f * 3 + j]] != id;
+                if (meshlet.nverts + added > MESHLET_MAX_VERTS) continue;
+
+                float score = added + CONE_WEIGHT * (1 - faceNormals[f] * axis);
+                if (score < best || (score == best && f < face))
+                {
+                    best = score;
+                    face = f;
+                }
+            }
+            candidates.resize(live);
+        }
+
+        computeMeshletBounds(verts, indices, &meshletFaces[meshlet.firstFace], meshlet);
+        meshlets.push_back(meshlet);
+    }
+}
+
+// FIFO post-transform cache: a vertex is resident while fewer than cacheSize
+// misses happened since it was last loaded
+struct VertexCache
+{
+    VertexCache(int nverts, int size) : stamps(nverts, 0), time(size + 1), size(size) {}
+
+    bool miss(int v)
+    {
+        if (time - stamps[v] <= size) return false;
+        stamps[v] = time++;
+        return true;
+    }
+
+    void flush() { time += size + 1; }
+
+    std::vector<int> stamps;
+    int time;
+    int size;
+};
+
+float acmr(const std::vector<int>& indices, int nverts, int cacheSize)
+{
+    if (indices.empty()) return 0;
+    VertexCache cache(nverts, cacheSize);
+    int misses = 0;
+    for (size_t i = 0; i < indices.size(); i++) misses += cache.miss(indices[i]);
+    return misses / (indices.size() / 3.f);
+}
+
+float overdraw(const std::vector<Vec3f>& verts, const std::vector<int>& indices)
+{
+    const int size = 256;
+    if (verts.empty() || indices.empty()) return 0;
+
+    Vec3f bmin = verts[0];
+    Vec3f bmax = verts[0];
+    for (size_t i = 0; i < verts.size(); i++)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            bmin[k] = std::min(bmin[k], verts[i][k]);
+            bmax[k] = std::max(bmax[k], verts[i][k]);
+        }
+    }
+    float extent = std::max(std::max(bmax[0] - bmin[0], bmax[1] - bmin[1]), bmax[2] - bmin[2]);
+    if (extent <= 0) return 0;
+    float scale = (size - 1) / extent;
+
+    std::vector<float> depth(size * size);
+    long covered = 0;
+    long shaded = 0;
+
+    for (int view = 0; view < 6; view++)
+    {
+        int axis = view / 2;
+        float dir = view % 2 ? -1.f : 1.f;
+        int u = (axis + 1) % 3;
+        int v = (axis + 2) % 3;
+        std::fill(depth.begin(), depth.end(), std::numeric_limits<float>::max());
+
+        for (size_t f = 0; f < indices.size(); f += 3)
+        {
+            const Vec3f& a = verts[indices[f]];
+            Vec3f n = cross(verts[indices[f + 1]] - a, verts[indices[f + 2]] - a);
+            if (n[axis] * dir >= 0) continue; // back facing, the meshlet cull gets most of those
+
+            Vec3f p[3];
+            for (int j = 0; j < 3; j++)
+            {
+                Vec3f q = verts[indices[f + j]] - bmin;
+                p[j] = Vec3f(q[u] * scale, q[v] * scale, q[axis] * dir);
+            }
+
+            float area = (p[1].x - p[0].x) * (p[2].y - p[0].y) - (p[2].x - p[0].x) * (p[1].y - p[0].y);
+            if (area == 0) continue;
+
+            int xmin = std::max(0, (int)std::min(std::min(p[0].x, p[1].x), p[2].x));
+            int xmax = std::min(size - 1, (int)std::max(std::max(p[0].x, p[1].x), p[2].x));
+            int ymin = std::max(0, (int)std::min(std::min(p[0].y, p[1].y), p[2].y));
+            int ymax = std::min(size - 1, (int)std::max(std::max(p[0].y, p[1].y), p[2].y));
+
+            for (int y = ymin; y <= ymax; y++)
+            {
+                for (int x = xmin; x <= xmax; x++)
+                {
+                    float px = x + .5f;
+                    float py = y + .5f;
+                    float w0 = ((p[2].x - p[1].x) * (py - p[1].y) - (p[2].y - p[1].y) * (px - p[1].x)) / area;
+                    float w1 = ((p[0].x - p[2].x) * (py - p[2].y) - (p[0].y - p[2].y) * (px - p[2].x)) / area;
+                    float w2 = 1 - w0 - w1;
+                    if (w0 < 0 || w1 < 0 || w2 < 0) continue;
+
+                    float z = p[0].z * w0 + p[1].z * w1 + p[2].z * w2;
+                    float& d = depth[x + y * size];
+                    if (z < d)
+                    {
+                        d = z;
+                        shaded++;
+                    }
+                }
+            }
+        }
+
+        for (size_t i = 0; i < depth.size(); i++) covered += depth[i] < std::numeric_limits<float>::max();
+    }
+
+    return covered ? shaded / (float)covered : 0;
+}
+
+// Tipsify (Sander et al. 2007): fan around the current vertex, then continue
+// with a neighbour that is still in the cache, or restart from a dead end.
+// Every restart is recorded in clusters as a hard boundary.
+static void tipsify(const std::vector<int>& indices, int nverts, int cacheSize,
+                    std::vector<int>& order, std::vector<int>& clusters)
+{
+    int nfaces = (int)indices.size() / 3;
+
+    Adjacency adj;
+    buildAdjacency(nverts, indices, adj);
+
+    std::vector<int> live(nverts);
+    for (int v = 0; v < nverts; v++) live[v] = adj.offsets[v + 1] - adj.offsets[v];
+
+    std::vector<int> stamps(nverts, 0);
+    std::vector<bool> emitted(nfaces, false);
+    std::vector<int> deadEnds;
+    std::vector<int> fan;
+
+    order.clear();
+    clusters.clear();
+    order.reserve(nfaces);
+
+    int time = cacheSize + 1;
+    int cursor = 0;
+    int current = -1;
+
+    while (true)
+    {
+        if (current < 0)
+        {
+            // dead end: reuse a recently touched vertex, otherwise scan ahead
+            while (!deadEnds.empty() && current < 0)
+            {
+                int v = deadEnds.back();
+                deadEnds.pop_back();
+                if (live[v] > 0) current = v;
+            }
+            while (current < 0 && cursor < nverts)
+            {
+                if (live[cursor] > 0) current = cursor;
+                cursor++;
+            }
+            if (current < 0) break;
+            clusters.push_back((int)order.size());
+        }
+
+        fan.clear();
+        for (int a = adj.offsets[current]; a < adj.offsets[current + 1]; a++)
+        {
+            int f = adj.faces[a];
+            if (emitted[f]) continue;
+            emitted[f] = true;
+            order.push_back(f);
+            for (int j = 0; j < 3; j++)
+            {
+                int v = indices[f * 3 + j];
+                deadEnds.push_back(v);
+                fan.push_back(v);
+                live[v]--;
+                if (time - stamps[v] > cacheSize) stamps[v] = time++;
+            }
+        }
+
+        // next fanning vertex: the oldest one that will still be cached after
+        // emitting all its remaining faces
+        int next = -1;
+        int best = -1;
+        for (size_t i = 0; i < fan.size(); i++)
+        {
+            int v = fan[i];
+            if (live[v] <= 0) continue;
+            int priority = 0;
+            if (time - stamps[v] + 2 * live[v] <= cacheSize) priority = time - stamps[v];
+            if (priority > best)
+            {
+                best = priority;
+                next = v;
+            }
+        }
+        current = next;
+    }
+}
+
+// Splits the hard clusters wherever the running miss ratio already reaches
+// the cluster average (Sander's soft boundaries), so that the clusters are
+// small enough to be sorted without hurting the cache much.
+static void splitClusters(const std::vector<int>& indices, int nverts, int cacheSize,
+                          const std::vector<int>& order, std::vector<int>& clusters)
+{
+    const float threshold = 1.05f;
+
+    std::vector<int> hard;
+    hard.swap(clusters);
+    hard.push_back((int)order.size());
+
+    VertexCache cache(nverts, cacheSize);
+    for (size_t c = 0; c + 1 < hard.size(); c++)
+    {
+        int start = hard[c];
+        int end = hard[c + 1];
+
+        cache.flush();
+        int misses = 0;
+        for (int i = start; i < end; i++)
+            for (int j = 0; j < 3; j++) misses += cache.miss(indices[order[i] * 3 + j]);
+        float target = threshold * misses / (end - start);
+
+        clusters.push_back(start);
+        cache.flush();
+        int runningMisses = 0;
+        int runningFaces = 0;
+        for (int i = start; i < end; i++)
+        {
+            for (int j = 0; j < 3; j++) runningMisses += cache.miss(indices[order[i] * 3 + j]);
+            runningFaces++;
+            if (runningMisses <= target * runningFaces)
+            {
+                clusters.push_back(i + 1);
+                cache.flush();
+                runningMisses = 0;
+                runningFaces = 0;
+            }
+        }
+
+        // the leftover tail is usually a poor cluster on its own, merge it
+        // with the last complete one
+        if (clusters.back() != start) clusters.pop_back();
+    }
+}
+
+struct ClusterKey
+{
+    float key;
+    int cluster;
+    bool operator<(const ClusterKey& other) const { return key > other.key; }
+};
+
+void optimizeFaceOrder(const std::vector<Vec3f>& verts, const std::vector<int>& indices, std::vector<int>& order)
+{
+    int nverts = (int)verts.size();
+    std::vector<int> clusters;
+    tipsify(indices, nverts, VERTEX_CACHE_SIZE, order, clusters);
+    if (order.empty()) return;
+    splitClusters(indices, nverts, VERTEX_CACHE_SIZE, order, clusters);
+    clusters.push_back((int)order.size());
+
+    Vec3f meshCentroid(0, 0, 0);
+    for (int i = 0; i < nverts; i++) meshCentroid = meshCentroid + verts[i];
+    meshCentroid = meshCentroid / (float)nverts;
+
+    // clusters far out along their own normal sit on the outside of the mesh
+    // and tend to occlude the rest, so they go first
+    std::vector<ClusterKey> keys(clusters.size() - 1);
+    for (size_t c = 0; c + 1 < clusters.size(); c++)
+    {
+        Vec3f centroid(0, 0, 0);
+        Vec3f normal(0, 0, 0);
+        float area = 0;
+        for (int i = clusters[c]; i < clusters[c + 1]; i++)
+        {
+            const int* f = &indices[order[i] * 3];
+            Vec3f n = cross(verts[f[1]] - verts[f[0]], verts[f[2]] - verts[f[0]]);
+            float a = n.norm();
+            centroid = centroid + (verts[f[0]] + verts[f[1]] + verts[f[2]]) * (a / 3);
+            normal = normal + n;
+            area += a;
+        }
+        if (area > 0) centroid = centroid / area;
+        float len = normal.norm();
+        if (len > 0) normal = normal / len;
+
+        keys[c].key = (centroid - meshCentroid) * normal;
+        keys[c].cluster = (int)c;
+    }
+    std::stable_sort(keys.begin(), keys.end());
+
+    std::vector<int> sorted;
+    sorted.reserve(order.size());
+    for (size_t k = 0; k < keys.size(); k++)
+    {
+        int c = keys[k].cluster;
+        sorted.insert(sorted.end(), order.begin() + clusters[c], order.begin() + clusters[c + 1]);
+    }
+    order.swap(sorted);
+}
+
+// plane distance quadric, a symmetric 4x4 matrix plus the accumulated weight
+struct Quadric
+{
+    Quadric() : weight(0) { for (int i = 10; i--; q[i] = 0); }
+
+    void addPlane(Vec3f n, float d, float w)
+    {
+        double p[4] = { n.x, n.y, n.z, d };
+        for (int i = 0, k = 0; i < 4; i++)
+            for (int j = i; j < 4; j++) q[k++] += w * p[i] * p[j];
+        weight += w;
+    }
+
+    void add(const Quadric& other)
+    {
+        for (int i = 10; i--; q[i] += other.q[i]);
+        weight += other.weight;
+    }
+
+    // weighted mean of the squared distances to the planes
+    double error(Vec3f v) const
+    {
+        double p[4] = { v.x, v.y, v.z, 1 };
+        double e = 0;
+        for (int i = 0, k = 0; i < 4; i++)
+            for (int j = i; j < 4; j++) e += (i == j ? 1 : 2) * q[k++] * p[i] * p[j];
+        return weight > 0 ? std::max(e, 0.) / weight : 0;
+    }
+
+    double q[10];
+    double weight;
+};
+
+struct Collapse
+{
+    double cost;
+    int from;
+    int to;
+    bool operator<(const Collapse& other) const { return cost < other.cost; }
+};
+
+static bool collapseFlips(const std::vector<Vec3f>& verts, const std::vector<int>& indices,
+                          const std::vector<bool>& alive, const std::vector<int>& fan, int from, int to)
+{
+    for (size_t i = 0; i < fan.size(); i++)
+    {
+        int f = fan[i];
+        if (!alive[f]) continue;
+        const int* v = &indices[f * 3];
+        if (v[0] == to || v[1] == to || v[2] == to) continue; // dies with the collapse
+
+        Vec3f p[3];
+        for (int j = 0; j < 3; j++) p[j] = verts[v[j]];
+        Vec3f before = cross(p[1] - p[0], p[2] - p[0]);
+        for (int j = 0; j < 3; j++) if (v[j] == from) p[j] = verts[to];
+        Vec3f after = cross(p[1] - p[0], p[2] - p[0]);
+
+        // reject flipped faces as well as faces turned into slivers
+        if (before * after < 0.25f * before.norm() * after.norm()) return true;
+    }
+    return false;
+}
+
+float simplify(const std::vector<Vec3f>& verts, const std::vector<bool>& locked,
+               std::vector<int>& indices, std::vector<int>& wedges, int targetFaces, float targetError)
+{
+    int nverts = (int)verts.size();
+    int nfaces = (int)indices.size() / 3;
+    int live = nfaces;
+
+    std::vector<std::vector<int> > fans(nverts);
+    std::vector<Quadric> quadrics(nverts);
+    for (int f = 0; f < nfaces; f++)
+    {
+        const int* v = &indices[f * 3];
+        Vec3f n = cross(verts[v[1]] - verts[v[0]], verts[v[2]] - verts[v[0]]);
+        float area = n.norm();
+        if (area > 0) n = n / area;
+        for (int j = 0; j < 3; j++)
+        {
+            fans[v[j]].push_back(f);
+            quadrics[v[j]].addPlane(n, -(n * verts[v[0]]), area);
+        }
+    }
+
+    // open borders and non manifold edges stay where they are
+    std::vector<bool> pinned(locked);
+    pinned.resize(nverts, false);
+    std::vector<std::pair<int, int> > edges;
+    edges.reserve(indices.size());
+    for (int f = 0; f < nfaces; f++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            int a = indices[f * 3 + j];
+            int b = indices[f * 3 + (j + 1) % 3];
+            edges.push_back(std::make_pair(std::min(a, b), std::max(a, b)));
+        }
+    }
+    std::sort(edges.begin(), edges.end());
+    for (size_t i = 0; i < edges.size(); )
+    {
+        size_t j = i;
+        while (j < edges.size() && edges[j] == edges[i]) j++;
+        if (j - i != 2) pinned[edges[i].first] = pinned[edges[i].second] = true;
+        i = j;
+    }
+
+    std::vector<bool> alive(nfaces, true);
+    std::vector<bool> touched(nverts);
+    std::vector<Collapse> collapses;
+    double limit = (double)targetError * targetError;
+    double reached = 0;
+
+    while (live > targetFaces)
+    {
+        edges.clear();
+        for (int f = 0; f < nfaces; f++)
+        {
+            if (!alive[f]) continue;
+            for (int j = 0; j < 3; j++)
+            {
+                int a = indices[f * 3 + j];
+                int b = indices[f * 3 + (j + 1) % 3];
+                edges.push_back(std::make_pair(std::min(a, b), std::max(a, b)));
+            }
+        }
+        std::sort(edges.begin(), edges.end());
+        edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+        collapses.clear();
+        for (size_t i = 0; i < edges.size(); i++)
+        {
+            int a = edges[i].first;
+            int b = edges[i].second;
+            Quadric q = quadrics[a];
+            q.add(quadrics[b]);
+
+            Collapse c;
+            c.cost = std::numeric_limits<double>::max();
+            if (!pinned[a])
+            {
+                c.cost = q.error(verts[b]);
+                c.from = a;
+                c.to = b;
+            }
+            if (!pinned[b] && q.error(verts[a]) < c.cost)
+            {
+                c.cost = q.error(verts[a]);
+                c.from = b;
+                c.to = a;
+            }
+            if (c.cost <= limit) collapses.push_back(c);
+        }
+        std::sort(collapses.begin(), collapses.end());
+
+        // every vertex takes part in at most one collapse per pass, so the
+        // costs and flip tests of the others stay valid
+        std::fill(touched.begin(), touched.end(), false);
+        int done = 0;
+        for (size_t i = 0; i < collapses.size() && live > targetFaces; i++)
+        {
+            const Collapse& c = collapses[i];
+            if (touched[c.from] || touched[c.to]) continue;
+            std::vector<int>& fan = fans[c.from];
+            if (collapseFlips(verts, indices, alive, fan, c.from, c.to)) continue;
+
+            int wedge = -1;
+            for (size_t k = 0; k < fan.size() && wedge < 0; k++)
+            {
+                int f = fan[k];
+                if (!alive[f]) continue;
+                for (int j = 0; j < 3; j++) if (indices[f * 3 + j] == c.to) wedge = wedges[f * 3 + j];
+            }
+
+            for (size_t k = 0; k < fan.size(); k++)
+            {
+                int f = fan[k];
+                if (!alive[f]) continue;
+                int* v = &indices[f * 3];
+                for (int j = 0; j < 3; j++) touched[v[j]] = true;
+                if (v[0] == c.to || v[1] == c.to || v[2] == c.to)
+                {
+                    alive[f] = false;
+                    live--;
+                    continue;
+                }
+                for (int j = 0; j < 3; j++)
+                {
+                    if (v[j] != c.from) continue;
+                    v[j] = c.to;
+                    wedges[f * 3 + j] = wedge;
+                }
+                fans[c.to].push_back(f);
+            }
+            fan.clear();
+
+            quadrics[c.to].add(quadrics[c.from]);
+            reached = std::max(reached, c.cost);
+            done++;
+        }
+        if (!done) break;
+    }
+
+    size_t out = 0;
+    for (int f = 0; f < nfaces; f++)
+    {
+        if (!alive[f]) continue;
+        for (int j = 0; j < 3; j++)
+        {
+            indices[out + j] = indices[f * 3 + j];
+            wedges[out + j] = wedges[f * 3 + j];
+        }
+        out += 3;
+    }
+    indices.resize(out);
+    wedges.resize(out);
+
+    return (float)std::sqrt(reached);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <vector>
+#include "geometry.h"
+
+const int MESHLET_MAX_VERTS = 64;
+const int MESHLET_MAX_FACES = 124;
+
+// a small cluster of neighbouring faces with conservative bounds, so that
+// the whole cluster can be rejected before any of its vertices are shaded
+struct Meshlet
+{
+    Meshlet() : firstFace(0), nfaces(0), nverts(0), center(), radius(0), coneAxis(), coneCutoff(1) {}
+
+    int firstFace;      // offset into the meshlet face list
+    int nfaces;
+    int nverts;
+
+    Vec3f center;       // bounding sphere
+    float radius;
+
+    Vec3f coneAxis;     // average face normal
+    float coneCutoff;   // sin of the normal cone half angle, 1 disables the cone test
+};
+
+// indices holds 3 position indices per face; meshletFaces receives the face
+// indices of every meshlet, meshlet i owning [firstFace, firstFace+nfaces)
+void buildMeshlets(const std::vector<Vec3f>& verts, const std::vector<int>& indices,
+                   std::vector<Meshlet>& meshlets, std::vector<int>& meshletFaces);
+
+const int VERTEX_CACHE_SIZE = 16;
+
+// average cache miss ratio: transformed vertices per face for a FIFO
+// post-transform cache of the given size
+float acmr(const std::vector<int>& indices, int nverts, int cacheSize = VERTEX_CACHE_SIZE);
+
+// shaded fragments per covered pixel when the front faces are drawn in order
+// with a depth test, averaged over the six axis aligned views
+float overdraw(const std::vector<Vec3f>& verts, const std::vector<int>& indices);
+
+// face order that is cache friendly (Tipsify) and, across clusters of faces,
+// roughly front to back; order receives the face indices in draw order
+void optimizeFaceOrder(const std::vector<Vec3f>& verts, const std::vector<int>& indices, std::vector<int>& order);
+
+// Quadric error edge collapse. indices holds 3 position indices per face and
+// wedges a parallel per-corner attribute id; collapsing p onto q moves p's
+// corners to q's position and q's wedge. Vertices flagged in locked (seams)
+// and on open borders never move. Stops at targetFaces faces or once the next
+// collapse would exceed targetError, and returns the largest distance error
+// of the collapses done. Dead faces are compacted out of indices and wedges.
+float simplify(const std::vector<Vec3f>& verts, const std::vector<bool>& locked,
+               std::vector<int>& indices, std::vector<int>& wedges, int targetFaces, float targetError);
@@ -1,17 +1,40 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <algorithm>
+#include <cmath>
 #include "model.h"
+#include "stats.h"
+#include "trace.h"
 
-Model::Model(const char *filename) : verts_(), faces_(), norms_(), uv_(), diffusemap_(), normalmap_(), specularmap_() {
+Model::Model(const char *filename, int flags) : verts_(), faces_(), norms_(), uv_(), face_material_(), materials_(), meshlet_material_(), diffusemap_(NULL), normalmap_(NULL), specularmap_(NULL), meshlets_(), meshlet_faces_(), meshlet_uv_density_(), lods_(), center_(), radius_(0), quantized_(false), qverts_(), qnorms_(), quv_(), qvert_min_(), qvert_step_(), quv_min_(), quv_step_() {
+    TRACE_SCOPE("load model");
     std::ifstream in;
     in.open (filename, std::ifstream::in);
-    if (in.fail()) return;
+    // a file that cannot be read gives an empty mesh, with its one level of
+    // detail and material like any other
+    if (in.fail()) std::cerr << "can't open file " << filename << std::endl;
+    std::string dir(filename);
+    dir = dir.substr(0, dir.find_last_of("/\\")+1);
+    std::vector<Material> library;
+    Material obj_maps = {"", {texture_path(filename, "_diffuse.tga"), texture_path(filename, "_nm_tangent.tga"), texture_path(filename, "_spec.tga")}, {NULL, NULL, NULL}};
+    //obj_maps.paths[1] = texture_path(filename, "_nm.tga");
+    materials_.push_back(obj_maps);
+    int current = 0;
+    // the maps decode on the prefetch threads while the geometry is parsed;
+    // those named after the obj file are started at its first vertex unless
+    // an mtllib came before, the others when a usemtl picks their material
+    const int formats[3] = {BLOCK_BC1, BLOCK_BC5, BLOCK_BC4};
+    bool compress = flags & COMPRESS_TEXTURES, started = false;
     std::string line;
-    while (!in.eof()) {
+    while (in.good()) {
         std::getline(in, line);
         std::istringstream iss(line.c_str());
         char trash;
+        if (!started && !line.compare(0, 2, "v ")) {
+            for (int k=0; k<3; k++) textureCache.prefetch(obj_maps.paths[k], compress ? formats[k] : TextureCache::DECODED);
+            started = true;
+        }
         if (!line.compare(0, 2, "v ")) {
             iss >> trash;
             Vec3f v;
@@ -36,23 +59,151 @@ Model::Model(const char *filename) : verts_(), faces_(), norms_(), uv_(), diffus
                 f.push_back(tmp);
             }
             faces_.push_back(f);
+            face_material_.push_back(current);
+        } else if (!line.compare(0, 7, "mtllib ")) {
+            std::string keyword, mtlfile;
+            iss >> keyword >> mtlfile;
+            load_materials(dir + mtlfile, library);
+            started = true;
+        } else if (!line.compare(0, 7, "usemtl ")) {
+            std::string keyword, name;
+            iss >> keyword >> name;
+            for (current=0; current<(int)materials_.size() && materials_[current].name!=name; current++);
+            if (current==(int)materials_.size()) {
+                int i = 0;
+                while (i<(int)library.size() && library[i].name!=name) i++;
+                if (i==(int)library.size()) {
+                    std::cerr << "material " << name << " not found" << std::endl;
+                    current = 0;
+                } else {
+                    materials_.push_back(library[i]);
+                    for (int k=0; k<3; k++) textureCache.prefetch(library[i].paths[k], compress ? formats[k] : TextureCache::DECODED);
+                }
+            }
         }
     }
     std::cerr << "# v# " << verts_.size() << " f# "  << faces_.size() << " vt# " << uv_.size() << " vn# " << norms_.size() << std::endl;
-    load_texture(filename, "_diffuse.tga", diffusemap_);
-    //load_texture(filename, "_nm.tga",      normalmap_);
-    load_texture(filename, "_nm_tangent.tga", normalmap_);
-    load_texture(filename, "_spec.tga",    specularmap_);
+    for (int i=0; i<(int)norms_.size(); i++) norms_[i].normalize();
+    group_by_material(0, faces_.size());
+    if (flags & OPTIMIZE) optimize();
+    build_lods(flags);
+    build_meshlets();
+
+    // only the maps of materials in use are read; those prefetched for a
+    // material no face ended up with are let go
+    std::vector<bool> used(materials_.size(), false);
+    for (int i=0; i<(int)face_material_.size(); i++) used[face_material_[i]] = true;
+    for (int m=0; m<nmaterials(); m++) {
+        for (int k=0; k<3; k++) {
+            int format = compress ? formats[k] : TextureCache::DECODED;
+            if (used[m]) materials_[m].maps[k] = textureCache.acquire(materials_[m].paths[k], format);
+            else textureCache.cancelPrefetch(materials_[m].paths[k], format);
+        }
+    }
+    if (flags & QUANTIZE) quantize();
+    if (nmaterials()>1) std::cerr << "# materials " << std::count(used.begin(), used.end(), true) << std::endl;
+    bind_material(0);
+}
+
+Model::~Model() {
+    for (int m=0; m<nmaterials(); m++)
+        for (int k=0; k<3; k++) textureCache.release(materials_[m].maps[k]);
+}
+
+// reads the materials of an mtl file; the maps are relative to it
+void Model::load_materials(const std::string &mtlfile, std::vector<Material> &library) {
+    std::ifstream in(mtlfile.c_str());
+    if (in.fail()) {
+        std::cerr << "material file " << mtlfile << " loading failed" << std::endl;
+        return;
+    }
+    std::string dir = mtlfile.substr(0, mtlfile.find_last_of("/\\")+1);
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream iss(line.c_str());
+        std::string keyword, arg, last;
+        iss >> keyword;
+        while (iss >> arg) last = arg; // the map follows any options
+        if (keyword=="newmtl") {
+            Material m = {last, {"", "", ""}, {NULL, NULL, NULL}};
+            library.push_back(m);
+        } else if (!library.empty() && !last.empty()) {
+            int k = -1;
+            if (keyword=="map_Kd") k = 0;
+            else if (keyword=="norm" || keyword=="map_Bump" || keyword=="map_bump" || keyword=="bump") k = 1;
+            else if (keyword=="map_Ks") k = 2;
+            if (k>=0) library.back().paths[k] = dir + last;
+        }
+    }
+}
+
+// sorts the faces of [first, first+n) by material, keeping their order within one
+void Model::group_by_material(int first, int n) {
+    std::vector<int> order(n);
+    for (int i=0; i<n; i++) order[i] = first + i;
+    std::stable_sort(order.begin(), order.end(), [this](int a, int b) { return face_material_[a]<face_material_[b]; });
+    std::vector<std::vector<Vec3i> > faces(n);
+    std::vector<int> materials(n);
+    for (int i=0; i<n; i++) {
+        faces[i].swap(faces_[order[i]]);
+        materials[i] = face_material_[order[i]];
+    }
+    for (int i=0; i<n; i++) {
+        faces_[first+i].swap(faces[i]);
+        face_material_[first+i] = materials[i];
+    }
+}
+
+int Model::nmaterials() {
+    return (int)materials_.size();
+}
+
+const Material &Model::material(int i) {
+    return materials_[i];
+}
+
+// bound in place of the maps that were not read, so that the samplers
+// always have a texture; it samples as black
+static CachedTexture no_map;
+
+void Model::bind_material(int i) {
+    diffusemap_ = materials_[i].maps[0] ? materials_[i].maps[0] : &no_map;
+    normalmap_ = materials_[i].maps[1] ? materials_[i].maps[1] : &no_map;
+    specularmap_ = materials_[i].maps[2] ? materials_[i].maps[2] : &no_map;
+}
+
+int Model::meshlet_material(int i) {
+    return meshlet_material_[i];
 }
 
-Model::~Model() {}
+float Model::meshlet_uv_density(int i) {
+    return meshlet_uv_density_[i];
+}
+
+float Model::map_variation() {
+    float variation = 0;
+    CachedTexture *maps[2] = {diffusemap_, normalmap_};
+    for (int k=0; k<2; k++) {
+        if (!maps[k]) continue;
+        int width = maps[k]->blocks.empty() ? maps[k]->image.get_width() : maps[k]->blocks.get_width();
+        variation += maps[k]->variation * width;
+    }
+    return variation;
+}
+
+void Model::prefetch_textures(const char *filename, int flags) {
+    int compress = flags & COMPRESS_TEXTURES;
+    textureCache.prefetch(texture_path(filename, "_diffuse.tga"), compress ? BLOCK_BC1 : TextureCache::DECODED);
+    textureCache.prefetch(texture_path(filename, "_nm_tangent.tga"), compress ? BLOCK_BC5 : TextureCache::DECODED);
+    textureCache.prefetch(texture_path(filename, "_spec.tga"), compress ? BLOCK_BC4 : TextureCache::DECODED);
+}
 
 int Model::nverts() {
-    return (int)verts_.size();
+    return quantized_ ? (int)qverts_.size()/3 : (int)verts_.size();
 }
 
 int Model::nfaces() {
-    return (int)faces_.size();
+    return lods_.empty() ? (int)faces_.size() : lods_[0].nfaces;
 }
 
 std::vector<int> Model::face(int idx) {
@@ -61,32 +212,309 @@ std::vector<int> Model::face(int idx) {
     return face;
 }
 
+int Model::nmeshlets() {
+    return (int)meshlets_.size();
+}
+
+const Meshlet &Model::meshlet(int i) {
+    return meshlets_[i];
+}
+
+int Model::meshlet_face(int i) {
+    return meshlet_faces_[i];
+}
+
+std::vector<int> Model::position_indices(int first, int n) {
+    std::vector<int> indices;
+    indices.reserve(n*3);
+    for (int i=first; i<first+n; i++)
+        for (int j=0; j<3; j++) indices.push_back(faces_[i][j][0]);
+    return indices;
+}
+
+// renumbers one attribute stream in order of first use and drops unused entries
+template <class T> static void remap_stream(std::vector<T> &stream, std::vector<std::vector<Vec3i> > &faces, int attr) {
+    std::vector<int> remap(stream.size(), -1);
+    std::vector<T> out;
+    out.reserve(stream.size());
+    for (int i=0; i<(int)faces.size(); i++) {
+        for (int j=0; j<(int)faces[i].size(); j++) {
+            int &idx = faces[i][j][attr];
+            if (idx<0 || idx>=(int)stream.size()) continue;
+            if (remap[idx]<0) {
+                remap[idx] = (int)out.size();
+                out.push_back(stream[idx]);
+            }
+            idx = remap[idx];
+        }
+    }
+    stream.swap(out);
+}
+
+void Model::optimize() {
+    TRACE_SCOPE("optimize mesh");
+    std::vector<int> indices = position_indices(0, faces_.size());
+    float acmr_before = acmr(indices, nverts());
+    float overdraw_before = overdraw(verts_, indices);
+
+    // the faces stay grouped by material
+    for (int first=0, end; first<(int)faces_.size(); first=end) {
+        for (end=first; end<(int)faces_.size() && face_material_[end]==face_material_[first]; end++);
+        std::vector<int> order;
+        optimizeFaceOrder(verts_, position_indices(first, end-first), order);
+        std::vector<std::vector<Vec3i> > faces(order.size());
+        for (int i=0; i<(int)order.size(); i++) faces[i].swap(faces_[first+order[i]]);
+        for (int i=0; i<(int)order.size(); i++) faces_[first+i].swap(faces[i]);
+    }
+
+    remap_stream(verts_, faces_, 0);
+    remap_stream(uv_,    faces_, 1);
+    remap_stream(norms_, faces_, 2);
+
+    indices = position_indices(0, faces_.size());
+    std::cerr << "# acmr " << acmr_before << " -> " << acmr(indices, nverts())
+              << " overdraw " << overdraw_before << " -> " << overdraw(verts_, indices) << std::endl;
+}
+
+void Model::build_lods(int flags) {
+    TRACE_SCOPE("build lods");
+    const int min_faces = 128;
+    const float max_error = .1f; // per level, relative to the bounding sphere
+
+    Vec3f bmin = verts_.empty() ? Vec3f() : verts_[0];
+    Vec3f bmax = bmin;
+    for (int i=0; i<nverts(); i++) {
+        for (int k=0; k<3; k++) {
+            bmin[k] = std::min(bmin[k], verts_[i][k]);
+            bmax[k] = std::max(bmax[k], verts_[i][k]);
+        }
+    }
+    center_ = (bmin+bmax)*.5f;
+    radius_ = 0;
+    for (int i=0; i<nverts(); i++) radius_ = std::max(radius_, (verts_[i]-center_).norm());
+
+    Lod full = {0, (int)faces_.size(), 0, 0, 0.f};
+    lods_.push_back(full);
+    if (!(flags & LODS)) return;
+
+    // a position with more than one uv/normal pair sits on a seam and must not move
+    std::vector<bool> locked(verts_.size(), false);
+    std::vector<Vec3i> first_use(verts_.size(), Vec3i(-1, -1, -1));
+    for (int i=0; i<(int)faces_.size(); i++) {
+        for (int j=0; j<3; j++) {
+            Vec3i c = faces_[i][j];
+            Vec3i &f = first_use[c[0]];
+            if (f[0]<0) f = c;
+            else if (f[1]!=c[1] || f[2]!=c[2]) locked[c[0]] = true;
+        }
+    }
+
+    while (lods_.back().nfaces>min_faces) {
+        Lod prev = lods_.back();
+        std::vector<int> indices = position_indices(prev.firstFace, prev.nfaces);
+        std::vector<int> wedges(indices.size());
+        for (int i=0; i<(int)wedges.size(); i++) wedges[i] = prev.firstFace*3 + i;
+
+        float error = simplify(verts_, locked, indices, wedges, prev.nfaces/2, radius_*max_error);
+        int n = (int)indices.size()/3;
+        if (n>prev.nfaces*9/10) break;
+
+        std::vector<int> order;
+        if (flags & OPTIMIZE) {
+            optimizeFaceOrder(verts_, indices, order);
+        } else {
+            for (int i=0; i<n; i++) order.push_back(i);
+        }
+
+        // the uv and normal of every corner come from the corner of the
+        // wedge, the material from the face of the first corner
+        std::vector<std::vector<Vec3i> > faces(n, std::vector<Vec3i>(3));
+        std::vector<int> materials(n);
+        for (int i=0; i<n; i++) {
+            for (int j=0; j<3; j++) {
+                int k = order[i]*3 + j;
+                Vec3i w = faces_[wedges[k]/3][wedges[k]%3];
+                faces[i][j] = Vec3i(indices[k], w[1], w[2]);
+            }
+            materials[i] = face_material_[wedges[order[i]*3]/3];
+        }
+
+        Lod lod = {(int)faces_.size(), n, 0, 0, prev.error + error};
+        faces_.insert(faces_.end(), faces.begin(), faces.end());
+        face_material_.insert(face_material_.end(), materials.begin(), materials.end());
+        group_by_material(lod.firstFace, n);
+        lods_.push_back(lod);
+    }
+
+    std::cerr << "# lods";
+    for (int i=0; i<nlods(); i++) std::cerr << " f# " << lods_[i].nfaces << " err " << lods_[i].error;
+    std::cerr << std::endl;
+}
+
+void Model::build_meshlets() {
+    TRACE_SCOPE("build meshlets");
+    std::vector<Meshlet> meshlets;
+    std::vector<int> faces;
+    for (int i=0; i<nlods(); i++) {
+        Lod &lod = lods_[i];
+        lod.firstMeshlet = (int)meshlets_.size();
+        // meshlets of one material after the other, so that a draw binds each once
+        int end = lod.firstFace + lod.nfaces;
+        for (int first=lod.firstFace, last; first<end; first=last) {
+            for (last=first; last<end && face_material_[last]==face_material_[first]; last++);
+            std::vector<int> indices = position_indices(first, last-first);
+            buildMeshlets(verts_, indices, meshlets, faces);
+            for (int m=0; m<(int)meshlets.size(); m++) {
+                float uv_area = 0, area = 0;
+                for (int k=0; k<meshlets[m].nfaces; k++) {
+                    int f = first + faces[meshlets[m].firstFace + k];
+                    Vec2f t1 = uv(f, 1) - uv(f, 0), t2 = uv(f, 2) - uv(f, 0);
+                    uv_area += std::abs(t1.x*t2.y - t1.y*t2.x);
+                    area += cross(vert(f, 1) - vert(f, 0), vert(f, 2) - vert(f, 0)).norm();
+                }
+                meshlet_uv_density_.push_back(area>0 ? std::sqrt(uv_area/area) : 0);
+                meshlets[m].firstFace += (int)meshlet_faces_.size();
+                meshlets_.push_back(meshlets[m]);
+                meshlet_material_.push_back(face_material_[first]);
+            }
+            for (int f=0; f<(int)faces.size(); f++) meshlet_faces_.push_back(first + faces[f]);
+        }
+        lod.nmeshlets = (int)meshlets_.size() - lod.firstMeshlet;
+    }
+    std::cerr << "# meshlets " << meshlets_.size() << std::endl;
+}
+
+int Model::nlods() {
+    return (int)lods_.size();
+}
+
+const Lod &Model::lod(int i) {
+    return lods_[i];
+}
+
+// the coarsest level whose error stays under max_pixels on screen
+int Model::select_lod(float pixels_per_unit, float max_pixels) {
+    for (int i=nlods()-1; i>0; i--) {
+        if (lods_[i].error*pixels_per_unit<=max_pixels) return i;
+    }
+    return 0;
+}
+
+// the step of 16 bit values spanning lo to hi
+static float quantization_step(float lo, float hi) {
+    return hi>lo ? (hi-lo)/65535.f : 1.f;
+}
+
+static unsigned short quantize_unorm(float v, float lo, float step) {
+    return (unsigned short)std::min(65535.f, std::max(0.f, (v-lo)/step + .5f));
+}
+
+static short quantize_snorm(float v) {
+    return (short)std::floor(std::min(1.f, std::max(-1.f, v))*32767.f + .5f);
+}
+
+void Model::quantize() {
+    TRACE_SCOPE("quantize");
+    size_t before = verts_.size()*sizeof(Vec3f) + norms_.size()*sizeof(Vec3f) + uv_.size()*sizeof(Vec2f);
+
+    Vec3f lo = verts_.empty() ? Vec3f() : verts_[0], hi = lo;
+    for (int i=0; i<(int)verts_.size(); i++)
+        for (int k=0; k<3; k++) {
+            lo[k] = std::min(lo[k], verts_[i][k]);
+            hi[k] = std::max(hi[k], verts_[i][k]);
+        }
+    qvert_min_ = lo;
+    for (int k=0; k<3; k++) qvert_step_[k] = quantization_step(lo[k], hi[k]);
+    qverts_.resize(verts_.size()*3);
+    for (int i=0; i<(int)verts_.size(); i++)
+        for (int k=0; k<3; k++) qverts_[i*3+k] = quantize_unorm(verts_[i][k], lo[k], qvert_step_[k]);
+
+    Vec2f uvlo = uv_.empty() ? Vec2f() : uv_[0], uvhi = uvlo;
+    for (int i=0; i<(int)uv_.size(); i++)
+        for (int k=0; k<2; k++) {
+            uvlo[k] = std::min(uvlo[k], uv_[i][k]);
+            uvhi[k] = std::max(uvhi[k], uv_[i][k]);
+        }
+    quv_min_ = uvlo;
+    for (int k=0; k<2; k++) quv_step_[k] = quantization_step(uvlo[k], uvhi[k]);
+    quv_.resize(uv_.size()*2);
+    for (int i=0; i<(int)uv_.size(); i++)
+        for (int k=0; k<2; k++) quv_[i*2+k] = quantize_unorm(uv_[i][k], uvlo[k], quv_step_[k]);
+
+    // projected onto the octahedron |x|+|y|+|z| = 1, the lower half folded out
+    qnorms_.resize(norms_.size()*2);
+    for (int i=0; i<(int)norms_.size(); i++) {
+        Vec3f n = norms_[i];
+        float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+        float x = l1>0 ? n.x/l1 : 0.f, y = l1>0 ? n.y/l1 : 0.f;
+        if (n.z<0) {
+            float fx = (1.f - std::abs(y))*(x<0 ? -1.f : 1.f);
+            y = (1.f - std::abs(x))*(y<0 ? -1.f : 1.f);
+            x = fx;
+        }
+        qnorms_[i*2] = quantize_snorm(x);
+        qnorms_[i*2+1] = quantize_snorm(y);
+    }
+
+    std::vector<Vec3f>().swap(verts_);
+    std::vector<Vec3f>().swap(norms_);
+    std::vector<Vec2f>().swap(uv_);
+    quantized_ = true;
+    size_t after = qverts_.size()*sizeof(unsigned short) + qnorms_.size()*sizeof(short) + quv_.size()*sizeof(unsigned short);
+    std::cerr << "# quantized attributes " << before/1024 << " KB -> " << after/1024 << " KB" << std::endl;
+}
+
+Vec3f Model::center() {
+    return center_;
+}
+
+float Model::radius() {
+    return radius_;
+}
+
 Vec3f Model::vert(int i) {
-    return verts_[i];
+    if (!quantized_) return verts_[i];
+    const unsigned short *q = &qverts_[i*3];
+    return Vec3f(qvert_min_.x + q[0]*qvert_step_.x, qvert_min_.y + q[1]*qvert_step_.y, qvert_min_.z + q[2]*qvert_step_.z);
 }
 
 Vec3f Model::vert(int iface, int nthvert) {
-    return verts_[faces_[iface][nthvert][0]];
+    return vert(faces_[iface][nthvert][0]);
 }
 
-void Model::load_texture(std::string filename, const char *suffix, TGAImage &img) {
+// the map of the model in filename with the given suffix instead of the extension
+std::string Model::texture_path(const char *filename, const char *suffix) {
     std::string texfile(filename);
     size_t dot = texfile.find_last_of(".");
-    if (dot!=std::string::npos) {
-        texfile = texfile.substr(0,dot) + std::string(suffix);
-        std::cerr << "texture file " << texfile << " loading " << (img.read_tga_file(texfile.c_str()) ? "ok" : "failed") << std::endl;
-        img.flip_vertically();
-    }
+    return dot!=std::string::npos ? texfile.substr(0,dot) + std::string(suffix) : std::string();
 }
 
 TGAColor Model::diffuse(Vec2f uvf) {
-    Vec2i uv(uvf[0]*diffusemap_.get_width(), uvf[1]*diffusemap_.get_height());
-    return diffusemap_.get(uv[0], uv[1]);
+    threadStats.textureFetches[DIFFUSE_MAP]++;
+    const BlockTexture &bc = diffusemap_->blocks;
+    if (!bc.empty()) {
+        Vec2i uv(uvf[0]*bc.get_width(), uvf[1]*bc.get_height());
+        return bc.get(uv[0], uv[1]);
+    }
+    TGAImage &map = diffusemap_->image;
+    Vec2i uv(uvf[0]*map.get_width(), uvf[1]*map.get_height());
+    return map.get(uv[0], uv[1]);
 }
 
 Vec3f Model::normal(Vec2f uvf) {
-    Vec2i uv(uvf[0]*normalmap_.get_width(), uvf[1]*normalmap_.get_height());
-    TGAColor c = normalmap_.get(uv[0], uv[1]);
+    threadStats.textureFetches[NORMAL_MAP]++;
+    const BlockTexture &bc = normalmap_->blocks;
+    if (!bc.empty()) {
+        // only x and y are kept, z comes back from the unit length
+        Vec2i uv(uvf[0]*bc.get_width(), uvf[1]*bc.get_height());
+        TGAColor c = bc.get(uv[0], uv[1]);
+        Vec3f res(c[2]/255.f*2.f - 1.f, c[1]/255.f*2.f - 1.f, 0.f);
+        res[2] = std::sqrt(std::max(0.f, 1.f - res[0]*res[0] - res[1]*res[1]));
+        return res;
+    }
+    TGAImage &map = normalmap_->image;
+    Vec2i uv(uvf[0]*map.get_width(), uvf[1]*map.get_height());
+    TGAColor c = map.get(uv[0], uv[1]);
     Vec3f res;
     for (int i=0; i<3; i++)
         res[2-i] = (float)c[i]/255.f*2.f - 1.f;
@@ -94,16 +522,34 @@ Vec3f Model::normal(Vec2f uvf) {
 }
 
 Vec2f Model::uv(int iface, int nthvert) {
-    return uv_[faces_[iface][nthvert][1]];
+    int idx = faces_[iface][nthvert][1];
+    if (!quantized_) return uv_[idx];
+    return Vec2f(quv_min_.x + quv_[idx*2]*quv_step_.x, quv_min_.y + quv_[idx*2+1]*quv_step_.y);
 }
 
 float Model::specular(Vec2f uvf) {
-    Vec2i uv(uvf[0]*specularmap_.get_width(), uvf[1]*specularmap_.get_height());
-    return specularmap_.get(uv[0], uv[1])[0]/1.f;
+    threadStats.textureFetches[SPECULAR_MAP]++;
+    const BlockTexture &bc = specularmap_->blocks;
+    if (!bc.empty()) {
+        Vec2i uv(uvf[0]*bc.get_width(), uvf[1]*bc.get_height());
+        return bc.get(uv[0], uv[1])[0]/1.f;
+    }
+    TGAImage &map = specularmap_->image;
+    Vec2i uv(uvf[0]*map.get_width(), uvf[1]*map.get_height());
+    return map.get(uv[0], uv[1])[0]/1.f;
 }
 
 Vec3f Model::normal(int iface, int nthvert) {
     int idx = faces_[iface][nthvert][2];
-    return norms_[idx].normalize();
+    if (!quantized_) return norms_[idx];
+    // the octahedron folded out onto the square, the lower half on the corners
+    Vec3f n(qnorms_[idx*2]/32767.f, qnorms_[idx*2+1]/32767.f, 0.f);
+    n.z = 1.f - std::abs(n.x) - std::abs(n.y);
+    if (n.z<0) {
+        float x = n.x;
+        n.x = (1.f - std::abs(n.y))*(x<0 ? -1.f : 1.f);
+        n.y = (1.f - std::abs(x))*(n.y<0 ? -1.f : 1.f);
+    }
+    return n.normalize();
 }
 
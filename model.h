@@ -4,6 +4,25 @@
 #include <string>
 #include "geometry.h"
 #include "tgaimage.h"
+#include "meshopt.h"
+#include "texturecache.h"
+
+// a level of detail: a range of faces and the meshlets built over it
+struct Lod {
+    int firstFace;
+    int nfaces;
+    int firstMeshlet;
+    int nmeshlets;
+    float error; // model space distance to the full resolution surface
+};
+
+// the maps of the faces after a usemtl line of the obj file; the first
+// material holds the faces before any, with maps named after the obj file
+struct Material {
+    std::string name;
+    std::string paths[3];   // diffuse, tangent space normals, specular
+    CachedTexture *maps[3]; // acquired for materials that have faces
+};
 
 class Model {
 private:
@@ -11,23 +30,75 @@ private:
     std::vector<std::vector<Vec3i> > faces_; // attention, this Vec3i means vertex/uv/normal
     std::vector<Vec3f> norms_;
     std::vector<Vec2f> uv_;
-    TGAImage diffusemap_;
-    TGAImage normalmap_;
-    TGAImage specularmap_;
-    void load_texture(std::string filename, const char *suffix, TGAImage &img);
+    std::vector<int> face_material_;
+    std::vector<Material> materials_;
+    std::vector<int> meshlet_material_;
+    CachedTexture *diffusemap_; // of the bound material, shared through textureCache
+    CachedTexture *normalmap_;
+    CachedTexture *specularmap_;
+    std::vector<Meshlet> meshlets_;
+    std::vector<int> meshlet_faces_;
+    std::vector<float> meshlet_uv_density_;
+    std::vector<Lod> lods_;
+    Vec3f center_;
+    float radius_;
+    // QUANTIZE: positions in 16 bit steps of the bounding box, normals
+    // octahedral in 2 x 16 bit snorm and uvs in 16 bit steps of their
+    // bounds, replacing verts_, norms_ and uv_ once the mesh is built
+    bool quantized_;
+    std::vector<unsigned short> qverts_;
+    std::vector<short> qnorms_;
+    std::vector<unsigned short> quv_;
+    Vec3f qvert_min_, qvert_step_;
+    Vec2f quv_min_, quv_step_;
+    void quantize();
+    static std::string texture_path(const char *filename, const char *suffix);
+    void load_materials(const std::string &mtlfile, std::vector<Material> &library);
+    void group_by_material(int first, int n);
+    std::vector<int> position_indices(int first, int n);
+    void optimize();
+    void build_lods(int flags);
+    void build_meshlets();
 public:
-    Model(const char *filename);
+    enum Flags {
+        OPTIMIZE=1, // reorder faces and vertices for the vertex cache and overdraw
+        LODS=2,     // build a chain of simplified levels of detail
+        COMPRESS_TEXTURES=4, // keep the maps block compressed: BC1 diffuse, BC5 normals, BC4 specular
+        QUANTIZE=8           // keep the vertex attributes in 16 bit integers
+    };
+
+    Model(const char *filename, int flags=0);
     ~Model();
+    Model(const Model &) = delete;
+    Model &operator=(const Model &) = delete;
+    // starts reading the maps of the model in filename in the background
+    static void prefetch_textures(const char *filename, int flags=0);
     int nverts();
     int nfaces();
     Vec3f normal(int iface, int nthvert);
     Vec3f normal(Vec2f uv);
     Vec3f vert(int i);
-    Vec3f vert(int iface, int nthvert);
+    Vec3f vert(int iface, int nthvert); // iface may address any level of detail
     Vec2f uv(int iface, int nthvert);
     TGAColor diffuse(Vec2f uv);
     float specular(Vec2f uv);
     std::vector<int> face(int idx);
+    int nmeshlets();
+    const Meshlet &meshlet(int i);
+    int meshlet_face(int i);
+    int meshlet_material(int i);
+    // uv units per model unit over the faces of meshlet i
+    float meshlet_uv_density(int i);
+    // mean change of the bound diffuse and normal maps per uv unit
+    float map_variation();
+    int nmaterials();
+    const Material &material(int i);
+    void bind_material(int i); // the maps diffuse(), normal() and specular() read
+    int nlods();
+    const Lod &lod(int i);
+    int select_lod(float pixels_per_unit, float max_pixels=1.f);
+    Vec3f center();
+    float radius();
 };
 #endif //__MODEL_H__
 
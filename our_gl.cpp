@@ -1,5 +1,8 @@
 
+#include <cstring>
+#include <algorithm>
 #include "our_gl.h"
+#include "aligned.h"
 #define PI 3.14159
 #define a2r(x) (PI / 180 * x)
 
@@ -200,6 +203,16 @@ void cameraView(Vec3f location, Vec3f rotation)
     CameraView = r_view * t_view;
 }
 
+// pixels [clipX0, clipX1) x [clipY0, clipY1) of the view that may be drawn,
+// narrowed by viewportBand and scissor, and the first row of the band; the
+// rasterizer moves the band to row 0 after snapping, so that a band comes out
+// exactly as that part of the whole image
+static int clipX0 = 0;
+static int clipY0 = 0;
+static int clipX1 = std::numeric_limits<int>::max();
+static int clipY1 = std::numeric_limits<int>::max();
+static int bandOrigin = 0;
+
 void viewport(int width, int height)
 {
     Viewport = Matrix::identity();
@@ -207,55 +220,672 @@ void viewport(int width, int height)
     Viewport[1][1] = height / 2;
     Viewport[0][3] = width / 2 + 0.5f;
     Viewport[1][3] = height / 2 + 0.5f;
+    clipX0 = 0;
+    clipY0 = 0;
+    clipX1 = width;
+    clipY1 = height;
+    bandOrigin = 0;
+}
+
+void viewportBand(int width, int height, int y0, int y1)
+{
+    viewport(width, height);
+    clipY0 = y0;
+    clipY1 = y1;
+    bandOrigin = y0;
+}
+
+void scissor(int x0, int y0, int x1, int y1)
+{
+    clipX0 = std::max(clipX0, x0);
+    clipY0 = std::max(clipY0, y0);
+    clipX1 = std::min(clipX1, x1);
+    clipY1 = std::min(clipY1, y1);
+}
+
+static bool equalDepth = false;
+
+void depthEqual(bool equal)
+{
+    equalDepth = equal;
+}
+
+static int blockRate = 1;
+
+void shadingRate(int rate)
+{
+    blockRate = rate;
+}
+
+static IPixelCache* pixelCache = NULL;
+
+void reusePixels(IPixelCache* cache)
+{
+    pixelCache = cache;
+}
+
+void setUniforms(Vec3f lightDir)
+{
+    uniforms.projection = Perspective * CameraView * ModelView;
+    uniforms.screen = Viewport * NDCView;
+    uniforms.mvp = uniforms.screen * uniforms.projection;
+
+    Matrix normalMatrix = ModelView.invert_transpose();
+    for (int i = 0; i < 3; i++) uniforms.normalMatrix[i] = proj<3>(normalMatrix[i]);
+
+    uniforms.light = (lightDir * -1.f).normalize();
+}
+
+CullVolume cullVolume()
+{
+    CullVolume volume;
+
+    // ndc range of the pixels that may be drawn; pixels are sampled at
+    // integer coordinates, one pixel of margin keeps the culling conservative
+    float low[3] = { -1.f, -1.f, -1.f };
+    float high[3] = { 1.f, 1.f, 1.f };
+    low[0] = std::max(-1.f, (clipX0 - 1 - Viewport[0][3]) / Viewport[0][0]);
+    high[0] = std::min(1.f, (clipX1 + 1 - Viewport[0][3]) / Viewport[0][0]);
+    low[1] = std::max(-1.f, (clipY0 - 1 - Viewport[1][3]) / Viewport[1][1]);
+    high[1] = std::min(1.f, (clipY1 + 1 - Viewport[1][3]) / Viewport[1][1]);
+
+    // clip space w is the (negative) view depth, so inside means
+    // high * w <= x,y,z <= low * w and the planes are read off the rows
+    Matrix clip = NDCView * Perspective * CameraView * ModelView;
+    for (int i = 0; i < 3; i++)
+    {
+        volume.planes[i * 2] = clip[3] * low[i] - clip[i];
+        volume.planes[i * 2 + 1] = clip[i] - clip[3] * high[i];
+    }
+    for (int i = 0; i < 6; i++)
+    {
+        Vec4f& p = volume.planes[i];
+        p = p / Vec3f(p[0], p[1], p[2]).norm();
+    }
+
+    Vec4f eye = (CameraView * ModelView).invert() * embed<4>(Vec3f(0, 0, 0));
+    volume.eye = proj<3>(eye / eye[3]);
+    return volume;
+}
+
+bool sphereCulled(const CullVolume& volume, Vec3f center, float radius)
+{
+    Vec4f c = embed<4>(center);
+    for (int i = 0; i < 6; i++)
+    {
+        if (volume.planes[i] * c < -radius) return true;
+    }
+    return false;
 }
 
-Vec3f barycentricCoord(const Vec4f* vertex, const Vec2f& point)
+bool coneCulled(const CullVolume& volume, Vec3f center, float radius, Vec3f coneAxis, float coneCutoff)
 {
-    float alpha = (-(point.x - vertex[1][0]) * (vertex[2][1] - vertex[1][1]) + (point.y - vertex[1][1]) * (vertex[2][0] - vertex[1][0])) / (-(vertex[0][0] - vertex[1][0]) * (vertex[2][1] - vertex[1][1]) + (vertex[0][1] - vertex[1][1]) * (vertex[2][0] - vertex[1][0]));
-    float beta = (-(point.x - vertex[2][0]) * (vertex[0][1] - vertex[2][1]) + (point.y - vertex[2][1]) * (vertex[0][0] - vertex[2][0])) / (-(vertex[1][0] - vertex[2][0]) * (vertex[0][1] - vertex[2][1]) + (vertex[1][1] - vertex[2][1]) * (vertex[0][0] - vertex[2][0]));
-    float gama = 1 - alpha - beta;
-    return Vec3f(alpha, beta, gama);
+    Vec3f view = center - volume.eye;
+    return view * coneAxis >= coneCutoff * view.norm() + radius;
+}
+
+float pixelsPerUnit(Vec3f center, float radius)
+{
+    // the view looks down -z, so moving towards the camera increases z
+    Vec4f c = CameraView * ModelView * embed<4>(center);
+    float depth = c[2] + radius;
+    if (depth >= 0) return std::numeric_limits<float>::max();
+
+    Matrix project = Viewport * NDCView * Perspective;
+    Vec4f a = project * embed<4>(Vec3f(0, 0, depth));
+    Vec4f b = project * embed<4>(Vec3f(0, 1, depth));
+    return std::abs(b[1] / b[3] - a[1] / a[3]);
+}
+
+// Triangle setup in fixed point: vertices are snapped to 1/SUBPIXEL_ONE of
+// a pixel and the edge functions evaluated exactly in 64 bit, so two faces
+// sharing an edge agree on every sample. Edge i is opposite vertex i and
+// e[i](x, y) = a[i] * x + b[i] * y + c[i] is positive inside; samples exactly
+// on an edge go to the face for which it is a top or left edge.
+struct EdgeSetup
+{
+    bool init(const Vec4f* vertex)
+    {
+        // there is no clipping, so keep the products below 2^63
+        const float guard = (float)(1 << 20);
+        clipped = true;
+        for (int i = 0; i < 3; i++)
+        {
+            if (!(std::abs(vertex[i][0]) < guard && std::abs(vertex[i][1]) < guard)) return false;
+            x[i] = (long long)std::floor((double)vertex[i][0] * SUBPIXEL_ONE + .5);
+            y[i] = (long long)std::floor((double)vertex[i][1] * SUBPIXEL_ONE + .5) - ((long long)bandOrigin << SUBPIXEL_BITS);
+        }
+
+        clipped = false;
+        area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+        if (area == 0) return false;
+        facing = area > 0 ? 1 : -1;
+
+        for (int i = 0; i < 3; i++)
+        {
+            int i1 = (i + 1) % 3;
+            int i2 = (i + 2) % 3;
+            a[i] = (y[i1] - y[i2]) * facing;
+            b[i] = (x[i2] - x[i1]) * facing;
+            c[i] = (x[i1] * y[i2] - x[i2] * y[i1]) * facing;
+            bias[i] = (a[i] > 0 || (a[i] == 0 && b[i] > 0)) ? 0 : -1;
+        }
+        area *= facing;
+        invArea = 1.f / area;
+        return true;
+    }
+
+    // pixel range whose samples, offset by up to margin, may be covered,
+    // within the target and the scissor
+    void bounds(long long margin, int width, int height, int& xmin, int& xmax, int& ymin, int& ymax) const
+    {
+        long long lo = std::min(std::min(x[0], x[1]), x[2]) - margin;
+        long long hi = std::max(std::max(x[0], x[1]), x[2]) + margin;
+        xmin = (int)std::max((long long)std::max(0, clipX0), (lo + SUBPIXEL_ONE - 1) >> SUBPIXEL_BITS);
+        xmax = (int)std::min((long long)std::min(width, clipX1) - 1, hi >> SUBPIXEL_BITS);
+        lo = std::min(std::min(y[0], y[1]), y[2]) - margin;
+        hi = std::max(std::max(y[0], y[1]), y[2]) + margin;
+        ymin = (int)std::max((long long)std::max(0, clipY0 - bandOrigin), (lo + SUBPIXEL_ONE - 1) >> SUBPIXEL_BITS);
+        ymax = (int)std::min((long long)std::min(height, clipY1 - bandOrigin) - 1, hi >> SUBPIXEL_BITS);
+    }
+
+    long long edge(int i, long long px, long long py) const
+    {
+        return a[i] * px + b[i] * py + c[i];
+    }
+
+    bool inside(const long long* e) const
+    {
+        return ((e[0] + bias[0]) | (e[1] + bias[1]) | (e[2] + bias[2])) >= 0;
+    }
+
+    // perspective divided barycentric coordinates, as fragment() expects them
+    Vec3f barycentric(const long long* e, const Vec4f* vertex) const
+    {
+        return Vec3f(e[0] * invArea / vertex[0][3], e[1] * invArea / vertex[1][3], e[2] * invArea / vertex[2][3]);
+    }
+
+    long long x[3], y[3];
+    long long a[3], b[3], c[3];
+    long long bias[3];
+    long long area;
+    float invArea;
+    int facing;
+    bool clipped;   // why init() failed: outside the guard band rather than no area
+};
+
+static float depth(const Vec3f& bc, const Vec4f* vertex)
+{
+    return (vertex[0][2] * bc.x + vertex[1][2] * bc.y + vertex[2][2] * bc.z) / (bc.x + bc.y + bc.z);
+}
+
+// counts a triangle that setup rejected
+static void rejected(const EdgeSetup& setup)
+{
+    if (setup.clipped) threadStats.trianglesClipped++;
+    else threadStats.trianglesCulled++;
+}
+
+// runs the fragment shader, reading the clock around every
+// FRAGMENT_TIMING_RATE-th call of the thread only so that timing stays cheap;
+// counting per thread rather than per triangle keeps the first fragment of
+// small triangles, which is the slowest, from being timed every time
+static inline bool shade(IShader& shader, const Vec3f& bc, TGAColor& color, long long& shaded, unsigned long long& cycles)
+{
+    if ((threadStats.pixelsShaded + shaded++) % FRAGMENT_TIMING_RATE) return shader.fragment(bc, color);
+    unsigned long long start = cycleCount();
+    bool keep = shader.fragment(bc, color);
+    cycles += (cycleCount() - start) * FRAGMENT_TIMING_RATE;
+    return keep;
+}
+
+// the fragment() result of one shadingRate() block of the current
+// triangle, for the block row being rasterized
+struct ShadedBlock
+{
+    ShadedBlock() : color(), state(-1) {}
+
+    TGAColor color;
+    signed char state;  // -1 not shaded yet, 0 discarded, 1 kept
+};
+
+static thread_local std::vector<ShadedBlock> shadedBlocks;
+
+// shades the block of pixel x at its first pixel that passes the depth
+// test, and hands the same color to the rest of it
+static inline bool shadeBlock(int x, int xmin, IShader& shader, const Vec3f& bc, TGAColor& color, long long& shaded,
+                              unsigned long long& cycles)
+{
+    ShadedBlock& block = shadedBlocks[x / blockRate - xmin / blockRate];
+    if (block.state < 0) block.state = shade(shader, bc, block.color, shaded, cycles);
+    color = block.color;
+    return block.state > 0;
+}
+
+static inline bool reuse(int x, int y, float z, TGAColor& color, long long& reused)
+{
+    if (!pixelCache || !pixelCache->reuse(x, y + bandOrigin, z, color)) return false;
+    reused++;
+    return true;
+}
+
+// adds the counters of one rasterized triangle to the thread's stats
+static void rasterized(unsigned long long start, long long tested, long long covered, long long depthRejected,
+                       long long shaded, long long reused, long long written, unsigned long long fragmentCycles)
+{
+    PipelineStats& stats = threadStats;
+    stats.trianglesRasterized++;
+    stats.pixelsTested += tested;
+    stats.pixelsCovered += covered;
+    stats.pixelsDepthRejected += depthRejected;
+    stats.pixelsShaded += shaded;
+    stats.pixelsReused += reused;
+    stats.pixelsWritten += written;
+    unsigned long long total = cycleCount() - start;
+    stats.cycles[STAGE_FRAGMENT] += fragmentCycles;
+    stats.cycles[STAGE_RASTER] += total > fragmentCycles ? total - fragmentCycles : 0;
 }
 
 TGAColor white(255, 255, 255, 255);
 
+// the storage of each DepthFormat; encode() keeps the order of z
+struct FloatDepth
+{
+    typedef float Stored;
+    static float encode(float z) { return z; }
+    static float decode(float stored) { return stored; }
+};
+
+template <int BITS, class T> struct UnormDepth
+{
+    typedef T Stored;
+    static T encode(float z)
+    {
+        const float top = (float)((1u << BITS) - 1);
+        return (T)std::min(top, std::max(0.f, (z + 1.f) * (top * .5f) + .5f));
+    }
+    static float decode(T stored) { return stored * (2.f / ((1u << BITS) - 1)) - 1.f; }
+};
+
+typedef UnormDepth<24, unsigned> Unorm24Depth;
+typedef UnormDepth<16, unsigned short> Unorm16Depth;
+
+template <class Depth> static void rasterize(const Vec4f* vertex, IShader& shader, TGAImage& image, zbuffer& zbuffer)
+{
+    unsigned long long start = cycleCount();
+    EdgeSetup setup;
+    if (!setup.init(vertex))
+    {
+        rejected(setup);
+        return;
+    }
+
+    int xmin, xmax, ymin, ymax;
+    setup.bounds(0, std::min(image.get_width(), zbuffer.size[0]), std::min(image.get_height(), zbuffer.size[1]), xmin, xmax, ymin, ymax);
+    zbuffer.touch(xmin, ymin, xmax, ymax);
+    long long covered = 0, depthRejected = 0, shaded = 0, reused = 0, written = 0;
+    unsigned long long fragmentCycles = 0;
+    if (blockRate > 1 && xmin <= xmax) shadedBlocks.resize(xmax / blockRate - xmin / blockRate + 1);
+
+    long long e[3];
+    long long row[3];
+    for (int i = 0; i < 3; i++) row[i] = setup.edge(i, (long long)xmin << SUBPIXEL_BITS, (long long)ymin << SUBPIXEL_BITS);
+
+    for (int y = ymin; y <= ymax; y++)
+    {
+        for (int i = 0; i < 3; i++) e[i] = row[i];
+        typename Depth::Stored* stored = (typename Depth::Stored*)zbuffer.buffer + (size_t)y * zbuffer.size[0];
+        // blocks are aligned to the whole view, so that bands agree with it
+        if (blockRate > 1 && (y == ymin || (y + bandOrigin) % blockRate == 0))
+        {
+            for (size_t i = 0; i < shadedBlocks.size(); i++) shadedBlocks[i].state = -1;
+        }
+
+        for (int x = xmin; x <= xmax; x++)
+        {
+            if (setup.inside(e))
+            {
+                Vec3f bc = setup.barycentric(e, vertex);
+                float z = depth(bc, vertex);
+                typename Depth::Stored zOrder = Depth::encode(z);
+
+                TGAColor color;
+                covered++;
+                if (equalDepth ? zOrder != stored[x] : zOrder < stored[x]) depthRejected++;
+                else if (reuse(x, y, z, color, reused) ||
+                         (blockRate > 1 ? shadeBlock(x, xmin, shader, bc, color, shaded, fragmentCycles)
+                                        : shade(shader, bc, color, shaded, fragmentCycles)))
+                {
+                    written++;
+                    stored[x] = zOrder;
+                    image.set(x, y, color);
+                }
+            }
+            for (int i = 0; i < 3; i++) e[i] += setup.a[i] << SUBPIXEL_BITS;
+        }
+        for (int i = 0; i < 3; i++) row[i] += setup.b[i] << SUBPIXEL_BITS;
+    }
+    long long tested = xmax < xmin || ymax < ymin ? 0 : (long long)(xmax - xmin + 1) * (ymax - ymin + 1);
+    rasterized(start, tested, covered, depthRejected, shaded, reused, written, fragmentCycles);
+}
+
 void triangle(const Vec4f* vertex, IShader& shader, TGAImage& image, zbuffer& zbuffer)
 {
-    int x_boundingBoxMax = (int)(std::max((std::max(vertex[0][0], vertex[1][0])), vertex[2][0]));
-    int x_boundingBoxMin = (int)(std::min((std::min(vertex[0][0], vertex[1][0])), vertex[2][0]));
-    int y_boundingBoxMax = (int)(std::max((std::max(vertex[0][1], vertex[1][1])), vertex[2][1]));
-    int y_boundingBoxMin = (int)(std::min((std::min(vertex[0][1], vertex[1][1])), vertex[2][1]));
+    switch (zbuffer.format)
+    {
+    case DEPTH_FLOAT32: rasterize<FloatDepth>(vertex, shader, image, zbuffer); break;
+    case DEPTH_UNORM24: rasterize<Unorm24Depth>(vertex, shader, image, zbuffer); break;
+    case DEPTH_UNORM16: rasterize<Unorm16Depth>(vertex, shader, image, zbuffer); break;
+    }
+}
+
+template <class Depth> static void rasterizeDepth(const Vec4f* vertex, zbuffer& zbuffer)
+{
+    EdgeSetup setup;
+    if (!setup.init(vertex)) return;
+
+    int xmin, xmax, ymin, ymax;
+    setup.bounds(0, zbuffer.size[0], zbuffer.size[1], xmin, xmax, ymin, ymax);
+    zbuffer.touch(xmin, ymin, xmax, ymax);
+    long long passed = 0;
+
+    long long e[3];
+    long long row[3];
+    for (int i = 0; i < 3; i++) row[i] = setup.edge(i, (long long)xmin << SUBPIXEL_BITS, (long long)ymin << SUBPIXEL_BITS);
+
+    for (int y = ymin; y <= ymax; y++)
+    {
+        for (int i = 0; i < 3; i++) e[i] = row[i];
+        typename Depth::Stored* stored = (typename Depth::Stored*)zbuffer.buffer + (size_t)y * zbuffer.size[0];
 
+        for (int x = xmin; x <= xmax; x++)
+        {
+            if (setup.inside(e))
+            {
+                typename Depth::Stored zOrder = Depth::encode(depth(setup.barycentric(e, vertex), vertex));
+                if (zOrder >= stored[x])
+                {
+                    stored[x] = zOrder;
+                    passed++;
+                }
+            }
+            for (int i = 0; i < 3; i++) e[i] += setup.a[i] << SUBPIXEL_BITS;
+        }
+        for (int i = 0; i < 3; i++) row[i] += setup.b[i] << SUBPIXEL_BITS;
+    }
+    threadStats.pixelsDepthOnly += passed;
+}
 
-    for (int x = x_boundingBoxMin; x <= x_boundingBoxMax; x++)
+void triangleDepth(const Vec4f* vertex, zbuffer& zbuffer)
+{
+    switch (zbuffer.format)
     {
-        if (x<0 || x > image.get_width())
-            continue;
+    case DEPTH_FLOAT32: rasterizeDepth<FloatDepth>(vertex, zbuffer); break;
+    case DEPTH_UNORM24: rasterizeDepth<Unorm24Depth>(vertex, zbuffer); break;
+    case DEPTH_UNORM16: rasterizeDepth<Unorm16Depth>(vertex, zbuffer); break;
+    }
+}
+
+int windingCount(const Vec4f* vertex, int width, int height, std::vector<int>& counts)
+{
+    EdgeSetup setup;
+    if (!setup.init(vertex)) return 0;
 
+    int xmin, xmax, ymin, ymax;
+    setup.bounds(0, width, height, xmin, xmax, ymin, ymax);
 
-        for (int y = y_boundingBoxMin; y <= y_boundingBoxMax; y++)
+    int covered = 0;
+    long long e[3];
+    for (int y = ymin; y <= ymax; y++)
+    {
+        for (int x = xmin; x <= xmax; x++)
         {
-            if (y<0 || y > image.get_height())
-                continue;
+            for (int i = 0; i < 3; i++) e[i] = setup.edge(i, (long long)x << SUBPIXEL_BITS, (long long)y << SUBPIXEL_BITS);
+            if (!setup.inside(e)) continue;
+            counts[x + y * width] += setup.facing;
+            covered++;
+        }
+    }
+    return covered;
+}
+
+static size_t depthBytes(DepthFormat format)
+{
+    return format == DEPTH_UNORM16 ? sizeof(unsigned short) : format == DEPTH_UNORM24 ? sizeof(unsigned) : sizeof(float);
+}
+
+zbuffer::zbuffer(Vec2i size, DepthFormat format)
+    : buffer(alignedAlloc((size_t)size[0] * size[1] * depthBytes(format))), size(size), format(format),
+      tilesX((size[0] + DEPTH_TILE - 1) / DEPTH_TILE), tilesY((size[1] + DEPTH_TILE - 1) / DEPTH_TILE),
+      stale(0), staleTiles(tilesX * tilesY)
+{
+    clear();
+}
+
+zbuffer::zbuffer(int width, int height, DepthFormat format) : zbuffer(Vec2i(width, height), format)
+{
+}
+
+zbuffer::~zbuffer()
+{
+    alignedFree(buffer);
+}
+
+void zbuffer::clear()
+{
+    std::fill(staleTiles.begin(), staleTiles.end(), 1);
+    stale = tilesX * tilesY;
+}
+
+void zbuffer::touchTiles(int x0, int y0, int x1, int y1)
+{
+    int tx0 = std::max(0, x0 / DEPTH_TILE), tx1 = std::min(tilesX - 1, x1 / DEPTH_TILE);
+    int ty0 = std::max(0, y0 / DEPTH_TILE), ty1 = std::min(tilesY - 1, y1 / DEPTH_TILE);
+    for (int ty = ty0; ty <= ty1; ty++)
+        for (int tx = tx0; tx <= tx1; tx++)
+        {
+            if (staleTiles[tx + ty * tilesX]) clearTile(tx, ty);
+        }
+}
+
+void zbuffer::flush()
+{
+    if (stale) touchTiles(0, 0, size[0] - 1, size[1] - 1);
+}
+
+void zbuffer::clearTile(int tx, int ty)
+{
+    staleTiles[tx + ty * tilesX] = 0;
+    stale--;
+    int x0 = tx * DEPTH_TILE, x1 = std::min(size[0], x0 + DEPTH_TILE);
+    int y0 = ty * DEPTH_TILE, y1 = std::min(size[1], y0 + DEPTH_TILE);
+    fill(x0, y0, x1, y1);
+}
+
+void zbuffer::fill(int x0, int y0, int x1, int y1)
+{
+    if (format != DEPTH_FLOAT32)
+    {
+        // the farthest unorm depth is 0
+        size_t bytes = depthBytes(format);
+        for (int y = y0; y < y1; y++) memset((unsigned char*)buffer + ((size_t)y * size[0] + x0) * bytes, 0, (x1 - x0) * bytes);
+        return;
+    }
+    const __m128 far = _mm_set1_ps(-std::numeric_limits<float>::max());
+    for (int y = y0; y < y1; y++)
+    {
+        float* row = (float*)buffer + (size_t)y * size[0];
+        int x = x0;
+        for (; x + 4 <= x1; x += 4) _mm_storeu_ps(row + x, far);
+        for (; x < x1; x++) row[x] = -std::numeric_limits<float>::max();
+    }
+}
+
+void zbuffer::clearRect(int x0, int y0, int x1, int y1)
+{
+    touch(x0, y0, x1 - 1, y1 - 1);
+    fill(x0, y0, x1, y1);
+}
+
+float zbuffer::load(size_t i) const
+{
+    switch (format)
+    {
+    case DEPTH_UNORM24: return Unorm24Depth::decode(((const unsigned*)buffer)[i]);
+    case DEPTH_UNORM16: return Unorm16Depth::decode(((const unsigned short*)buffer)[i]);
+    default: return ((const float*)buffer)[i];
+    }
+}
+
+float zbuffer::get(int x, int y)
+{
+    if (x < 0 || y < 0 || x >= size[0] || y >= size[1]) {
+        return std::numeric_limits<float>::max();
+    }
+    touch(x, y, x, y);
+    return load(x + (size_t)y * size[0]);
+}
+
+bool zbuffer::set(int x, int y, float value)
+{
+    if (x < 0 || y < 0 || x >= size[0] || y >= size[1]) {
+        return false;
+    }
+    touch(x, y, x, y);
+    size_t i = x + (size_t)y * size[0];
+    switch (format)
+    {
+    case DEPTH_UNORM24: ((unsigned*)buffer)[i] = Unorm24Depth::encode(value); break;
+    case DEPTH_UNORM16: ((unsigned short*)buffer)[i] = Unorm16Depth::encode(value); break;
+    default: ((float*)buffer)[i] = value; break;
+    }
+    return true;
+}
 
-            Vec3f bc = barycentricCoord(vertex, Vec2f(x, y));
-            if (bc.x < 0 || bc.y < 0 || bc.z < 0) continue;// ڵĵ
-            bc.x /= vertex[0][3];
-            bc.y /= vertex[1][3];
-            bc.z /= vertex[2][3];
-            float zn = 1 / (bc[0] + bc[1] + bc[2]);
+void zbuffer::read(float* depths)
+{
+    flush();
+    size_t n = (size_t)size[0] * size[1];
+    if (format == DEPTH_FLOAT32) memcpy(depths, buffer, n * sizeof(float));
+    else for (size_t i = 0; i < n; i++) depths[i] = load(i);
+}
 
-            float zOrder = (vertex[0][2] * bc.x + vertex[1][2] * bc.y + vertex[2][2] * bc.z) * zn;
+MsaaTarget::MsaaTarget(int width, int height, int bytespp) :
+    width(width), height(height), bytespp(bytespp),
+    depth(width * height * MSAA_SAMPLES), color(width * height * MSAA_SAMPLES * bytespp)
+{
+    clear();
+}
 
-            if (zOrder < zbuffer.get(x, y)) continue;
+void MsaaTarget::clear()
+{
+    std::fill(depth.begin(), depth.end(), -std::numeric_limits<float>::max());
+    std::fill(color.begin(), color.end(), 0);
+}
+
+void MsaaTarget::resolve(TGAImage& image)
+{
+    int n = std::min(bytespp, image.get_bytespp());
+    for (int y = 0; y < std::min(height, image.get_height()); y++)
+    {
+        for (int x = 0; x < std::min(width, image.get_width()); x++)
+        {
+            const unsigned char* samples = &color[(x + y * width) * MSAA_SAMPLES * bytespp];
+            TGAColor c;
+            c.bytespp = image.get_bytespp();
+            for (int i = 0; i < n; i++)
+            {
+                int sum = 0;
+                for (int s = 0; s < MSAA_SAMPLES; s++) sum += samples[s * bytespp + i];
+                c[i] = (unsigned char)((sum + MSAA_SAMPLES / 2) / MSAA_SAMPLES);
+            }
+            image.set(x, y, c);
+        }
+    }
+}
+
+// rotated grid, offsets from the pixel center in 1/8 pixel
+static const int msaaPattern[MSAA_SAMPLES][2] = {
+    { -1, -3 }, { 3, -1 }, { -3, 1 }, { 1, 3 }
+};
+
+void triangle(const Vec4f* vertex, IShader& shader, MsaaTarget& target)
+{
+    unsigned long long start = cycleCount();
+    EdgeSetup setup;
+    if (!setup.init(vertex))
+    {
+        rejected(setup);
+        return;
+    }
+
+    const int unit = SUBPIXEL_ONE / 8;
+    int xmin, xmax, ymin, ymax;
+    setup.bounds(3 * unit, target.width, target.height, xmin, xmax, ymin, ymax);
+    long long covered = 0, depthRejected = 0, shaded = 0, written = 0;
+    unsigned long long fragmentCycles = 0;
+
+    // edge function offsets of the samples relative to the pixel center
+    long long offset[MSAA_SAMPLES][3];
+    for (int s = 0; s < MSAA_SAMPLES; s++)
+        for (int i = 0; i < 3; i++)
+            offset[s][i] = (setup.a[i] * msaaPattern[s][0] + setup.b[i] * msaaPattern[s][1]) * unit;
+
+    long long center[3];
+    long long e[3];
+    for (int y = ymin; y <= ymax; y++)
+    {
+        for (int x = xmin; x <= xmax; x++)
+        {
+            for (int i = 0; i < 3; i++) center[i] = setup.edge(i, (long long)x << SUBPIXEL_BITS, (long long)y << SUBPIXEL_BITS);
+
+            float* depths = &target.depth[(x + y * target.width) * MSAA_SAMPLES];
+            float zSamples[MSAA_SAMPLES] = {};
+            int mask = 0;
+            int first = -1;
+            bool inside = false;
+
+            for (int s = 0; s < MSAA_SAMPLES; s++)
+            {
+                for (int i = 0; i < 3; i++) e[i] = center[i] + offset[s][i];
+                if (!setup.inside(e)) continue;
+
+                inside = true;
+                float zOrder = depth(setup.barycentric(e, vertex), vertex);
+                if (zOrder < depths[s]) continue;
+
+                zSamples[s] = zOrder;
+                mask |= 1 << s;
+                if (first < 0) first = s;
+            }
+            covered += inside;
+            if (!mask)
+            {
+                depthRejected += inside;
+                continue;
+            }
+
+            // shade at the pixel center, or at a covered sample when the
+            // center lies outside and the attributes would be extrapolated
+            for (int i = 0; i < 3; i++) e[i] = center[i];
+            if (!setup.inside(e))
+            {
+                for (int i = 0; i < 3; i++) e[i] += offset[first][i];
+            }
 
             TGAColor color;
+            if (!shade(shader, setup.barycentric(e, vertex), color, shaded, fragmentCycles)) continue;
+            written++;
 
-            if (shader.fragment(bc, color))
+            unsigned char* samples = &target.color[(x + y * target.width) * MSAA_SAMPLES * target.bytespp];
+            for (int s = 0; s < MSAA_SAMPLES; s++)
             {
-                zbuffer.set(x, y, zOrder);
-                image.set(x, y, color);
+                if (!(mask & (1 << s))) continue;
+                depths[s] = zSamples[s];
+                memcpy(samples + s * target.bytespp, color.bgra, target.bytespp);
             }
         }
     }
-}
\ No newline at end of file
+    long long tested = xmax < xmin || ymax < ymin ? 0 : (long long)(xmax - xmin + 1) * (ymax - ymin + 1);
+    rasterized(start, tested, covered, depthRejected, shaded, 0, written, fragmentCycles);
+}
@@ -2,6 +2,9 @@
 
 #include "tgaimage.h"
 #include "geometry.h"
+#include "stats.h"
+#include <limits>
+#include <vector>
 
 extern Matrix ModelView;
 extern Matrix CameraView;
@@ -11,12 +14,53 @@ extern Matrix Orthographic;
 extern Matrix Viewport;
 extern Matrix NDCView;
 
+// per draw constants derived from the matrices above, so that shaders do
+// not rebuild them for every vertex and fragment
+struct Uniforms
+{
+    Uniforms() : projection(), screen(), mvp(), normalMatrix(), light() {}
+
+    Matrix projection;              // Perspective * CameraView * ModelView
+    Matrix screen;                  // Viewport * NDCView
+    Matrix mvp;                     // screen * projection
+    mat<3, 3, float> normalMatrix;  // inverse transpose of ModelView, for normals
+    Vec3f light;                    // unit vector towards the light, same space as the normals
+};
+
+extern Uniforms uniforms;
+
 void modelView(Vec3f location, Vec3f rotation);
 void perspective(float near, float far, float fov, float aspect);
 void ndcView(float near, float far, float fov, float aspect);
 void orthographic(float near, float far, float fov, float aspect, float width);
 void viewport(int width, int height);
+// viewport for drawing rows [y0, y1) of a width x height view into a target
+// of y1 - y0 rows; meshlets outside the band are culled. The shaders still
+// see whole-view coordinates, only the rasterizer moves the band to row 0.
+void viewportBand(int width, int height, int y0, int y1);
+// restricts drawing to pixels [x0, x1) x [y0, y1) of the view, both in the
+// rasterizer and in the cull volume, until the next viewport call
+void scissor(int x0, int y0, int x1, int y1);
 void cameraView(Vec3f location, Vec3f rotation);
+void setUniforms(Vec3f lightDir);
+
+// view volume of the current draw in model space, used to reject whole
+// meshlets before their vertices reach the shader
+struct CullVolume
+{
+    CullVolume() : planes(), eye() {}
+
+    Vec4f planes[6];
+    Vec3f eye;
+};
+
+CullVolume cullVolume();
+bool sphereCulled(const CullVolume& volume, Vec3f center, float radius);
+bool coneCulled(const CullVolume& volume, Vec3f center, float radius, Vec3f coneAxis, float coneCutoff);
+
+// on-screen pixels covered by one model space unit at the point of the
+// sphere nearest to the camera, used to pick a level of detail
+float pixelsPerUnit(Vec3f center, float radius);
 
 struct IShader
 {
@@ -25,53 +69,121 @@ struct IShader
     virtual bool fragment(Vec3f barycentricCoord, TGAColor& color) = 0;
 };
 
+// hands fragments colors kept from an earlier frame, see reproject.h
+struct IPixelCache
+{
+    virtual ~IPixelCache() {};
+    // the color of pixel x, y of the whole view at depth z when one can be
+    // reused instead of running fragment(); called for every fragment that
+    // passes the depth test, so the last call for a pixel is the one kept
+    virtual bool reuse(int x, int y, float z, TGAColor& color) = 0;
+};
+
+// coarse shading for the following draws: the single sampled triangle()
+// runs fragment() once per rate x rate block of pixels it covers, at the
+// first pixel of the block that passes the depth test, and gives every
+// other pixel of the block that passes it the same color; coverage and
+// depth stay per pixel. 1 (the default) shades every pixel, 2 and 4 are
+// the coarse rates.
+void shadingRate(int rate);
+
+// cache for the following draws to take colors from, NULL (the default) to
+// shade every fragment; the multisampled triangle() always shades
+void reusePixels(IPixelCache* cache);
+
+const int DEPTH_TILE = 32;
+
+// how zbuffer stores a depth. The unorm formats keep the NDC z of [-1, 1]
+// in steps of 2 / (2^bits - 1), clamped, with the near plane on the largest
+// value so that larger stays nearer as with floats; 24 bit depths take a
+// 32 bit word each, as on GPUs, so only 16 bit halves the memory.
+enum DepthFormat
+{
+    DEPTH_FLOAT32,
+    DEPTH_UNORM24,
+    DEPTH_UNORM16
+};
+
+// Depth buffer, a larger z is nearer. clear() is lazy: it marks every
+// DEPTH_TILE square of pixels stale, and a stale tile is filled with the
+// farthest depth once a draw reaches it, so parts of the view that nothing
+// covers are never written. Direct readers of buffer call flush() first.
 struct zbuffer
 {
-    zbuffer(Vec2i size)
-    {
-        this->size = size;
-        buffer = new float[size[0] * size[1]];
-        for (int i = size[0] * size[1]; i--; buffer[i] = -std::numeric_limits<float>::max());
-    }
+    zbuffer(Vec2i size, DepthFormat format = DEPTH_FLOAT32);
+    zbuffer(int width, int height, DepthFormat format = DEPTH_FLOAT32);
+    ~zbuffer();
 
-    zbuffer(int width, int height)
-    {
-        this->size = Vec2i(width, height);
-        buffer = new float[size[0] * size[1]];
-        for (int i = size[0] * size[1]; i--; buffer[i] = -std::numeric_limits<float>::max());
-    }
+    zbuffer(const zbuffer&) = delete;
+    zbuffer& operator=(const zbuffer&) = delete;
 
-    ~zbuffer()
+    void clear();
+    // clears the stale tiles among those overlapping pixels [x0, x1] x [y0, y1]
+    void touch(int x0, int y0, int x1, int y1)
     {
-        delete buffer;
+        if (stale) touchTiles(x0, y0, x1, y1);
     }
+    // clears every stale tile
+    void flush();
+    // sets pixels [x0, x1) x [y0, y1) back to the farthest depth
+    void clearRect(int x0, int y0, int x1, int y1);
 
-    void clear()
-    {
-        for (int i = size[0] * size[1]; i--; buffer[i] = -std::numeric_limits<float>::max());
-    }
+    float get(int x, int y);
+    bool set(int x, int y, float value);
+    // every depth as a float, row by row
+    void read(float* depths);
 
-    float* buffer;
+    void* buffer;           // float, or unsigned or unsigned short for the unorm formats
     Vec2i size;
+    DepthFormat format;
 
-public:
-    float get(int x, int y)
-    {
-        if (x < 0 || y < 0 || x >= size[0] || y >= size[1]) {
-            return std::numeric_limits<float>::max();
-        }
-        return buffer[x + y * size[0]];
-    }
+private:
+    void touchTiles(int x0, int y0, int x1, int y1);
+    void clearTile(int tx, int ty);
+    void fill(int x0, int y0, int x1, int y1);
+    float load(size_t i) const;
 
-    bool set(int x, int y, float value)
-    {
-        if (x < 0 || y < 0 || x >= size[0] || y >= size[1]) {
-            return false;
-        }
-        buffer[x + y * size[0]] = value;
-        return true;
-    }
+    int tilesX;
+    int tilesY;
+    int stale;                          // number of stale tiles
+    std::vector<unsigned char> staleTiles;
+};
+
+const int MSAA_SAMPLES = 4;
+
+// 4x multisampled color and depth. Coverage and depth are tested per sample,
+// fragment() runs once per covered pixel and its color goes to every sample
+// that passed; resolve() averages the samples into a regular image.
+struct MsaaTarget
+{
+    MsaaTarget(int width, int height, int bytespp);
 
+    void clear();
+    void resolve(TGAImage& image);
+
+    int width;
+    int height;
+    int bytespp;
+    std::vector<float> depth;           // MSAA_SAMPLES per pixel
+    std::vector<unsigned char> color;   // MSAA_SAMPLES * bytespp per pixel
 };
 
-void triangle(const Vec4f* vertex, IShader& shader, TGAImage& image, zbuffer& zbuffer);
\ No newline at end of file
+// screen positions are snapped to 1/SUBPIXEL_ONE pixel before rasterization
+const int SUBPIXEL_BITS = 8;
+const int SUBPIXEL_ONE = 1 << SUBPIXEL_BITS;
+
+void triangle(const Vec4f* vertex, IShader& shader, TGAImage& image, zbuffer& zbuffer);
+void triangle(const Vec4f* vertex, IShader& shader, MsaaTarget& target);
+
+// depth pre-pass: writes the depth of the triangle where it is nearest and
+// nothing else. After it, depthEqual(true) makes the single sampled
+// triangle() shade only fragments at exactly the stored depth, so each
+// pixel runs fragment() once (twice for exact ties) with the same result
+// as a single pass.
+void triangleDepth(const Vec4f* vertex, zbuffer& zbuffer);
+void depthEqual(bool equal);
+
+// adds the winding (+1 or -1) of the triangle to every pixel it covers and
+// returns the number of pixels covered; over a closed mesh every count must
+// come back to zero, otherwise the rasterizer left a crack or hit a pixel twice
+int windingCount(const Vec4f* vertex, int width, int height, std::vector<int>& counts);
\ No newline at end of file
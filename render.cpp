@@ -0,0 +1,266 @@
+#include <algorithm>
+#include <cmath>
+#include "render.h"
+#include "trace.h"
+
+Vec4f GouraudShader::vertex(int iface, int nthvert)
+{
+    uv[nthvert] = model->uv(iface, nthvert);
+    vertex_normal[nthvert] = model->normal(iface, nthvert);
+    vertex_pos[nthvert] = model->vert(iface, nthvert);
+
+    // the tangent only depends on the face, so it is built once the last
+    // vertex is in rather than for every fragment
+    if (nthvert == 2)
+    {
+        Vec2f delta_vu1 = uv[2] - uv[0];
+        Vec2f delta_vu2 = uv[1] - uv[0];
+        Vec3f E1 = vertex_pos[2] - vertex_pos[0];
+        Vec3f E2 = vertex_pos[1] - vertex_pos[0];
+
+        tangent = (E2 * delta_vu1[0] - E1 * delta_vu2[0]) / (delta_vu1[0] * delta_vu2[1] - delta_vu2[0] * delta_vu1[1]);
+        tangent.normalize();
+    }
+
+    Vec4f ver = uniforms.mvp * embed<4>(vertex_pos[nthvert]);
+    float temp = ver[3];
+    ver = ver / ver[3];
+    ver[3] = temp;
+    return ver;
+}
+
+bool GouraudShader::fragment(Vec3f barycentricCoord, TGAColor& color)
+{
+    float zn = 1 / (barycentricCoord[0] + barycentricCoord[1] + barycentricCoord[2]);
+    float light;
+
+    Vec2f bar_uv = (uv[0] * barycentricCoord.x + uv[1] * barycentricCoord.y + uv[2] * barycentricCoord.z) * zn;
+    Vec3f bar_normal = uniforms.normalMatrix * ((vertex_normal[0] * barycentricCoord.x + vertex_normal[1] * barycentricCoord.y + vertex_normal[2] * barycentricCoord.z) * zn);
+    bar_normal.normalize();
+
+    Vec3f T = (tangent - bar_normal * (tangent * bar_normal)).normalize();
+    Vec3f B = cross(bar_normal, T).normalize();
+    mat<3, 3, float> TBN;
+    TBN[0] = T;
+    TBN[1] = B;
+    TBN[2] = bar_normal;
+
+    Vec3f normal_tangent = TBN * model->normal(bar_uv);
+    light = std::max(0.f, normal_tangent * uniforms.light);
+
+    if (!lights)
+    {
+        color = model->diffuse(bar_uv) * light;
+        return true;
+    }
+
+    // the lights binned to the pixel, found again from the position
+    Vec3f bar_pos = (vertex_pos[0] * barycentricCoord.x + vertex_pos[1] * barycentricCoord.y + vertex_pos[2] * barycentricCoord.z) * zn;
+    Vec4f screen = uniforms.mvp * embed<4>(bar_pos);
+    int count;
+    const int* list = lights->tileLights((int)std::floor(screen[0] / screen[3] + .5f), (int)std::floor(screen[1] / screen[3] + .5f), count);
+    Vec3f position = proj<3>(ModelView * embed<4>(bar_pos));
+    Vec3f rgb(light, light, light);
+    for (int i = 0; i < count; i++) rgb = rgb + illuminate(lights->lights()[list[i]], position, normal_tangent);
+
+    color = model->diffuse(bar_uv);
+    for (int i = 0; i < 3; i++) color[i] = (unsigned char)std::min(255.f, color[i] * rgb[2 - i]);
+    return true;
+}
+
+Vec4f flootShader::vertex(int iface, int nthvert)
+{
+    uv[nthvert] = model->uv(iface, nthvert);
+    Vec4f ver = embed<4>(model->vert(iface, nthvert));
+
+    ver = uniforms.projection * ver;
+    float temp = ver[3];
+    ver = ver / ver[3];
+    ver[2] = temp;
+    ver = uniforms.screen * ver;
+    ver[3] = temp;
+    return ver;
+}
+
+bool flootShader::fragment(Vec3f barycentricCoord, TGAColor& color)
+{
+    float zn = 1 / (barycentricCoord[0] + barycentricCoord[1] + barycentricCoord[2]);
+    Vec2f bar_uv = (uv[0] * barycentricCoord.x + uv[1] * barycentricCoord.y + uv[2] * barycentricCoord.z) * zn;
+    color = model->diffuse(bar_uv);
+    return true;
+}
+
+// the coarsest shading rate of meshlet m for the current view, with the
+// maps of its material bound
+static int meshletRate(int m)
+{
+    const Meshlet& meshlet = model->meshlet(m);
+    float pixels = pixelsPerUnit(meshlet.center, meshlet.radius);
+    // the normals turn by up to the cone angle over the meshlet, and the
+    // diffuse term by as much; a disabled cone spreads over 90 degrees
+    float spread = meshlet.coneCutoff >= 1 ? 1.5708f : std::asin(meshlet.coneCutoff);
+    float perUnit = model->map_variation() * model->meshlet_uv_density(m) + spread / std::max(meshlet.radius, 1e-6f);
+    float perPixel = perUnit / pixels;
+    int rate = 4;
+    while (rate > 1 && perPixel * (rate - 1) > SHADING_ERROR) rate /= 2;
+    return rate;
+}
+
+// shades, or with depthOnly only writes the depth of, the faces of meshlets,
+// and returns the number of material binds; the meshlets of a material are
+// contiguous, so each is bound once. coarse counts the meshlets shaded at a
+// rate above 1x1
+static int drawMeshlets(IShader& shader, TGAImage& image, zbuffer& zbuffer, MsaaTarget* msaa,
+                        const std::vector<int>& meshlets, bool depthOnly, int rate, int& coarse)
+{
+    Vec4f vertex[3];
+    PipelineStats& stats = threadStats;
+    unsigned long long begin = cycleCount();
+    int bound = -1, binds = 0;
+    for (size_t m = 0; m < meshlets.size(); m++)
+    {
+        const Meshlet& meshlet = model->meshlet(meshlets[m]);
+        int material = model->meshlet_material(meshlets[m]);
+        if (!depthOnly && material != bound)
+        {
+            model->bind_material(material);
+            bound = material;
+            binds++;
+        }
+        if (!depthOnly)
+        {
+            int chosen = rate == SHADING_RATE_AUTO ? meshletRate(meshlets[m]) : rate;
+            shadingRate(chosen);
+            coarse += chosen > 1;
+        }
+        TRACE_SCOPE(depthOnly ? "meshlet depth" : "meshlet");
+        for (int k = 0; k < meshlet.nfaces; k++)
+        {
+            int i = model->meshlet_face(meshlet.firstFace + k);
+            unsigned long long start = cycleCount();
+            for (int j = 0; j < 3; j++)
+            {
+                vertex[j] = shader.vertex(i, j);
+            }
+            if (depthOnly)
+            {
+                triangleDepth(vertex, zbuffer);
+                continue;
+            }
+            stats.cycles[STAGE_VERTEX] += cycleCount() - start;
+            if (msaa) triangle(vertex, shader, *msaa);
+            else triangle(vertex, shader, image, zbuffer);
+        }
+    }
+    if (depthOnly) stats.cycles[STAGE_PREPASS] += cycleCount() - begin;
+    shadingRate(1);
+    return binds;
+}
+
+// picks the level of detail of the current view and its meshlets that are
+// neither outside the view volume nor facing away
+static DrawInfo visibleMeshlets(std::vector<int>& meshlets)
+{
+    DrawInfo info;
+    info.lod = model->select_lod(pixelsPerUnit(model->center(), model->radius()));
+    const Lod& lod = model->lod(info.lod);
+    info.meshlets = lod.nmeshlets;
+    info.faces = lod.nfaces;
+    info.culledMeshlets = 0;
+    info.culledFaces = 0;
+    info.materialBinds = 0;
+    info.coarseMeshlets = 0;
+    info.prepass = false;
+
+    CullVolume volume = cullVolume();
+    PipelineStats& stats = threadStats;
+    stats.trianglesSubmitted += lod.nfaces;
+
+    meshlets.reserve(lod.nmeshlets);
+    for (int m = lod.firstMeshlet; m < lod.firstMeshlet + lod.nmeshlets; m++)
+    {
+        const Meshlet& meshlet = model->meshlet(m);
+        if (sphereCulled(volume, meshlet.center, meshlet.radius) ||
+            coneCulled(volume, meshlet.center, meshlet.radius, meshlet.coneAxis, meshlet.coneCutoff))
+        {
+            info.culledMeshlets++;
+            info.culledFaces += meshlet.nfaces;
+            stats.trianglesCulled += meshlet.nfaces;
+            continue;
+        }
+        meshlets.push_back(m);
+    }
+    return info;
+}
+
+DrawInfo drawModel(IShader& shader, TGAImage& image, zbuffer& zbuffer, MsaaTarget* msaa, bool prepass, int rate)
+{
+    TRACE_SCOPE("draw");
+    std::vector<int> meshlets;
+    DrawInfo info = visibleMeshlets(meshlets);
+    info.prepass = prepass && !msaa;
+    if (!info.prepass)
+    {
+        info.materialBinds = drawMeshlets(shader, image, zbuffer, msaa, meshlets, false, rate, info.coarseMeshlets);
+        return info;
+    }
+    drawMeshlets(shader, image, zbuffer, NULL, meshlets, true, rate, info.coarseMeshlets);
+    depthEqual(true);
+    info.materialBinds = drawMeshlets(shader, image, zbuffer, NULL, meshlets, false, rate, info.coarseMeshlets);
+    depthEqual(false);
+    return info;
+}
+
+DrawInfo drawModelLit(GouraudShader& shader, TGAImage& image, zbuffer& zbuffer, const std::vector<Light>& lights, LightGrid& grid,
+                      int rate)
+{
+    TRACE_SCOPE("draw lit");
+    std::vector<int> meshlets;
+    DrawInfo info = visibleMeshlets(meshlets);
+    info.prepass = true;
+    drawMeshlets(shader, image, zbuffer, NULL, meshlets, true, rate, info.coarseMeshlets);
+    {
+        TRACE_SCOPE("bin lights");
+        grid.build(lights, zbuffer);
+    }
+    shader.lights = &grid;
+    depthEqual(true);
+    info.materialBinds = drawMeshlets(shader, image, zbuffer, NULL, meshlets, false, rate, info.coarseMeshlets);
+    depthEqual(false);
+    shader.lights = NULL;
+    return info;
+}
+
+PrepassHeuristic::PrepassHeuristic()
+    : usePrepass(true), sinceProbe(0), fragmentCost(0), hidden(0), visible(0), prepassCost(0)
+{
+}
+
+bool PrepassHeuristic::choose() const
+{
+    return usePrepass || sinceProbe >= PROBE_INTERVAL;
+}
+
+void PrepassHeuristic::update(const DrawInfo& info, const PipelineStats& before, const PipelineStats& after)
+{
+    long long shaded = after.pixelsShaded - before.pixelsShaded;
+    if (shaded) fragmentCost = (double)(after.cycles[STAGE_FRAGMENT] - before.cycles[STAGE_FRAGMENT]) / shaded;
+    if (!info.prepass)
+    {
+        sinceProbe++;
+        return;
+    }
+
+    // the pre-pass shades about one fragment per pixel, the depth only
+    // pass counts what a single pass would have shaded
+    visible = shaded;
+    hidden = std::max(0LL, after.pixelsDepthOnly - before.pixelsDepthOnly - shaded);
+    prepassCost = (double)(after.cycles[STAGE_PREPASS] - before.cycles[STAGE_PREPASS]);
+    usePrepass = hidden * fragmentCost > prepassCost;
+    sinceProbe = 0;
+}
+
+double PrepassHeuristic::overdraw() const
+{
+    return visible ? (double)(visible + hidden) / visible : 0;
+}
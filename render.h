@@ -0,0 +1,101 @@
+#pragma once
+
+#include "tgaimage.h"
+#include "model.h"
+#include "our_gl.h"
+#include "lights.h"
+
+// the model the shaders read their attributes from
+extern Model* model;
+
+struct GouraudShader : IShader
+{
+    GouraudShader() : vertex_normal(), vertex_pos(), uv(), tangent(), lights(NULL) {}
+    GouraudShader(const GouraudShader&) = delete;
+    GouraudShader& operator=(const GouraudShader&) = delete;
+
+    Vec3f vertex_normal[3];
+    Vec3f vertex_pos[3];
+    Vec2f uv[3];
+    Vec3f tangent;
+    // local lights added to the directional one, binned for the frame being
+    // shaded; NULL for none
+    const LightGrid* lights;
+
+    virtual Vec4f vertex(int iface, int nthvert);
+    virtual bool fragment(Vec3f barycentricCoord, TGAColor& color);
+};
+
+struct flootShader : IShader
+{
+    Vec2f uv[3];
+
+    virtual Vec4f vertex(int iface, int nthvert);
+    virtual bool fragment(Vec3f barycentricCoord, TGAColor& color);
+};
+
+// what drawModel picked and rejected for one draw
+struct DrawInfo
+{
+    int lod;
+    int meshlets;
+    int culledMeshlets;
+    int faces;
+    int culledFaces;
+    int materialBinds;
+    int coarseMeshlets; // shaded at a rate above 1x1
+    bool prepass;
+};
+
+// drawModel picks the shading rate of each meshlet
+const int SHADING_RATE_AUTO = 0;
+// the color change allowed across a coarse shading block, as a fraction of
+// the full range, when the rate is picked per meshlet
+const float SHADING_ERROR = 1.f / 32;
+
+// draws the level of detail picked for the current view, skipping meshlets
+// that are outside the view volume or facing away; msaa, when not NULL,
+// replaces image and zbuffer as the render target. With prepass the
+// surviving meshlets are drawn twice, depth only and then shading only the
+// nearest fragments; multisampled draws ignore it. The meshlets of each
+// material are drawn together with its maps bound once. rate is passed to
+// shadingRate(); with SHADING_RATE_AUTO every meshlet gets the coarsest rate
+// at which its estimated color change per pixel, from the variation of the
+// maps per texel and the spread of its normals, stays within SHADING_ERROR
+// over a block.
+DrawInfo drawModel(IShader& shader, TGAImage& image, zbuffer& zbuffer, MsaaTarget* msaa, bool prepass = false,
+                   int rate = 1);
+
+// drawModel with the depth pre-pass and local lights: between the passes
+// grid bins lights over the depth drawn so far, and the shading pass adds
+// the lights of each fragment's tile to the directional light
+DrawInfo drawModelLit(GouraudShader& shader, TGAImage& image, zbuffer& zbuffer, const std::vector<Light>& lights, LightGrid& grid,
+                      int rate = 1);
+
+// Decides for one model whether the depth pre-pass pays: it does when the
+// fragments a single pass shades and then overwrites cost more than the
+// second geometry pass. A pre-pass draw measures both; a single pass draw
+// only the cost of a fragment, so the pre-pass is tried again every
+// PROBE_INTERVAL draws in case the overdraw has grown.
+class PrepassHeuristic
+{
+public:
+    static const int PROBE_INTERVAL = 16;
+
+    PrepassHeuristic();
+
+    // whether the next draw should use the pre-pass
+    bool choose() const;
+    // takes the thread's counters from before and after a draw
+    void update(const DrawInfo& info, const PipelineStats& before, const PipelineStats& after);
+    // fragments shaded by a single pass per pixel drawn, from the last pre-pass draw
+    double overdraw() const;
+
+private:
+    bool usePrepass;
+    int sinceProbe;
+    double fragmentCost;    // cycles per fragment() call
+    long long hidden;       // fragments a single pass would shade in vain
+    long long visible;
+    double prepassCost;     // cycles of the depth only pass
+};
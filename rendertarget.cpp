@@ -0,0 +1,64 @@
+#include "rendertarget.h"
+
+RenderTargetPool::RenderTargetPool() : mutex(), colors(), depths()
+{
+}
+
+RenderTargetPool::~RenderTargetPool()
+{
+    for (size_t i = 0; i < colors.size(); i++) delete colors[i];
+    for (size_t i = 0; i < depths.size(); i++) delete depths[i];
+}
+
+TGAImage* RenderTargetPool::acquireColor(int width, int height, int bytespp)
+{
+    TGAImage* image = NULL;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < colors.size(); i++)
+        {
+            TGAImage* c = colors[i];
+            if (c->get_width() == width && c->get_height() == height && c->get_bytespp() == bytespp)
+            {
+                image = c;
+                colors.erase(colors.begin() + i);
+                break;
+            }
+        }
+    }
+    if (!image) return new TGAImage(width, height, bytespp);
+    image->clear();
+    return image;
+}
+
+zbuffer* RenderTargetPool::acquireDepth(int width, int height, DepthFormat format)
+{
+    zbuffer* depth = NULL;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < depths.size(); i++)
+        {
+            if (depths[i]->size[0] == width && depths[i]->size[1] == height && depths[i]->format == format)
+            {
+                depth = depths[i];
+                depths.erase(depths.begin() + i);
+                break;
+            }
+        }
+    }
+    if (!depth) return new zbuffer(width, height, format);
+    depth->clear();
+    return depth;
+}
+
+void RenderTargetPool::release(TGAImage* image)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    colors.push_back(image);
+}
+
+void RenderTargetPool::release(zbuffer* depth)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    depths.push_back(depth);
+}
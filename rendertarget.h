@@ -0,0 +1,30 @@
+#pragma once
+
+#include <mutex>
+#include <vector>
+#include "tgaimage.h"
+#include "our_gl.h"
+
+// Keeps color and depth buffers that renders are done with and hands them
+// out again by size and format, so that batch renders allocate each size
+// once. Buffers come back cleared, depth lazily (see zbuffer). Safe to use
+// from several threads.
+class RenderTargetPool
+{
+public:
+    RenderTargetPool();
+    ~RenderTargetPool();
+
+    RenderTargetPool(const RenderTargetPool&) = delete;
+    RenderTargetPool& operator=(const RenderTargetPool&) = delete;
+
+    TGAImage* acquireColor(int width, int height, int bytespp);
+    zbuffer* acquireDepth(int width, int height, DepthFormat format = DEPTH_FLOAT32);
+    void release(TGAImage* image);
+    void release(zbuffer* depth);
+
+private:
+    std::mutex mutex;
+    std::vector<TGAImage*> colors;
+    std::vector<zbuffer*> depths;
+};
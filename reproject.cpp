@@ -0,0 +1,98 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "reproject.h"
+
+// depth difference below which a stored pixel counts as the same surface;
+// the stored depth is interpolated perspective correctly while the
+// reprojection is projective, so the two never agree exactly
+static const float DEPTH_TOLERANCE = 1e-3f;
+
+ReprojectionCache::ReprojectionCache(int width, int height, int bytespp, int maxAge)
+    : width(width), height(height), bytespp(bytespp), maxAge(maxAge), stored(false), mvp(), toStored(),
+      color((size_t)width * height * bytespp), depth((size_t)width * height), age((size_t)width * height),
+      nextAge((size_t)width * height)
+{
+}
+
+ReprojectionCache::~ReprojectionCache()
+{
+    reusePixels(NULL);
+}
+
+void ReprojectionCache::begin()
+{
+    // pixels that are never drawn keep an age of 0; after a full frame
+    // the ages start staggered so that not every pixel expires at once
+    for (size_t i = 0; i < nextAge.size(); i++) nextAge[i] = stored ? 0 : (unsigned char)((i % width * 3 + i / width * 5) % maxAge);
+    if (!stored) return;
+    toStored = mvp * uniforms.mvp.invert();
+    reusePixels(this);
+}
+
+void ReprojectionCache::store(TGAImage& image, zbuffer& zbuffer)
+{
+    reusePixels(NULL);
+    memcpy(color.data(), image.buffer(), color.size());
+    zbuffer.read(depth.data());
+    age.swap(nextAge);
+    mvp = uniforms.mvp;
+    stored = true;
+}
+
+bool ReprojectionCache::reuse(int x, int y, float z, TGAColor& out)
+{
+    size_t i = x + (size_t)y * width;
+    nextAge[i] = 0;
+
+    Vec4f p = toStored * embed<4>(Vec3f((float)x, (float)y, z));
+    if (p[3] == 0) return false;
+    float sx = p[0] / p[3], sy = p[1] / p[3], sz = p[2] / p[3];
+    float fx = std::floor(sx), fy = std::floor(sy);
+    if (!(fx >= 0 && fy >= 0 && fx < width - 1 && fy < height - 1)) return false;
+
+    size_t j = (size_t)fx + (size_t)fy * width;
+    const size_t taps[4] = { j, j + 1, j + width, j + width + 1 };
+    for (int t = 0; t < 4; t++)
+    {
+        if (!(std::abs(depth[taps[t]] - sz) <= DEPTH_TOLERANCE)) return false;
+    }
+
+    // the age follows the nearest pixel, which keeps the expiry staggered
+    float wx = sx - fx, wy = sy - fy;
+    const float weights[4] = { (1 - wx) * (1 - wy), wx * (1 - wy), (1 - wx) * wy, wx * wy };
+    int pixelAge = age[taps[(wx >= .5f) + 2 * (wy >= .5f)]];
+    if (pixelAge + 1 >= maxAge) return false;
+    out.bytespp = (unsigned char)bytespp;
+    for (int c = 0; c < bytespp; c++)
+    {
+        float sum = .5f;
+        for (int t = 0; t < 4; t++) sum += weights[t] * color[taps[t] * bytespp + c];
+        out[c] = (unsigned char)std::min(255.f, sum);
+    }
+    nextAge[i] = (unsigned char)(pixelAge + 1);
+    return true;
+}
+
+double psnr(TGAImage& a, TGAImage& b, int& differing)
+{
+    size_t pixels = (size_t)a.get_width() * a.get_height();
+    int bytespp = a.get_bytespp();
+    const unsigned char* pa = a.buffer();
+    const unsigned char* pb = b.buffer();
+    double squared = 0;
+    differing = 0;
+    for (size_t i = 0; i < pixels; i++)
+    {
+        bool same = true;
+        for (int c = 0; c < bytespp; c++, pa++, pb++)
+        {
+            int d = *pa - *pb;
+            squared += d * d;
+            same &= d == 0;
+        }
+        differing += !same;
+    }
+    if (squared == 0) return std::numeric_limits<double>::infinity();
+    return 10 * std::log10(255. * 255. * pixels * bytespp / squared);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <vector>
+#include "our_gl.h"
+
+// Keeps the color and depth of one frame for the next frame of a camera
+// sweep. Every fragment of the new frame that passes the depth test is
+// taken back to the stored frame with the inverse of the current mvp and
+// the stored one; when the four stored pixels around it hold the same
+// surface their colors are blended in instead of running fragment(), so
+// only pixels that came into view are shaded. Shading must not depend on
+// the camera, and a pixel reused maxAge - 1 frames in a row is shaded again
+// so that the resampling error does not build up.
+class ReprojectionCache : public IPixelCache
+{
+public:
+    ReprojectionCache(int width, int height, int bytespp, int maxAge = 8);
+    ~ReprojectionCache();
+
+    ReprojectionCache(const ReprojectionCache&) = delete;
+    ReprojectionCache& operator=(const ReprojectionCache&) = delete;
+
+    // lets the following draws reuse the stored frame, if there is one,
+    // from the view of the current uniforms.mvp
+    void begin();
+    // keeps image and zbuffer, drawn since begin(), as the stored frame
+    void store(TGAImage& image, zbuffer& zbuffer);
+
+    virtual bool reuse(int x, int y, float z, TGAColor& color);
+
+private:
+    int width;
+    int height;
+    int bytespp;
+    int maxAge;
+    bool stored;
+    Matrix mvp;                         // of the stored frame
+    Matrix toStored;                    // current screen space to the stored one
+    std::vector<unsigned char> color;   // stored frame
+    std::vector<float> depth;
+    std::vector<unsigned char> age;     // frames each stored pixel has been reused
+    std::vector<unsigned char> nextAge; // the same for the frame being drawn
+};
+
+// peak signal to noise ratio of b against a in dB, infinite when they are
+// equal; differing counts the pixels that are not exactly the same
+double psnr(TGAImage& a, TGAImage& b, int& differing);
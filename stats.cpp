@@ -0,0 +1,93 @@
+#include <mutex>
+#include "stats.h"
+
+thread_local PipelineStats threadStats;
+
+static std::mutex mergeMutex;
+
+static const char* STAGE_NAMES[PIPELINE_STAGES] = {"vertex", "raster", "fragment", "prepass"};
+static const char* MAP_NAMES[TEXTURE_MAPS] = {"diffuse", "normal", "specular"};
+
+PipelineStats::PipelineStats()
+    : trianglesSubmitted(0), trianglesCulled(0), trianglesClipped(0), trianglesRasterized(0),
+      pixelsTested(0), pixelsCovered(0), pixelsDepthRejected(0), pixelsShaded(0), pixelsReused(0), pixelsWritten(0), pixelsDepthOnly(0),
+      textureFetches(), cycles()
+{
+}
+
+void PipelineStats::clear()
+{
+    *this = PipelineStats();
+}
+
+void PipelineStats::add(const PipelineStats& other)
+{
+    trianglesSubmitted += other.trianglesSubmitted;
+    trianglesCulled += other.trianglesCulled;
+    trianglesClipped += other.trianglesClipped;
+    trianglesRasterized += other.trianglesRasterized;
+    pixelsTested += other.pixelsTested;
+    pixelsCovered += other.pixelsCovered;
+    pixelsDepthRejected += other.pixelsDepthRejected;
+    pixelsShaded += other.pixelsShaded;
+    pixelsReused += other.pixelsReused;
+    pixelsWritten += other.pixelsWritten;
+    pixelsDepthOnly += other.pixelsDepthOnly;
+    for (int i = 0; i < TEXTURE_MAPS; i++) textureFetches[i] += other.textureFetches[i];
+    for (int i = 0; i < PIPELINE_STAGES; i++) cycles[i] += other.cycles[i];
+}
+
+void mergeThreadStats(PipelineStats& frame)
+{
+    std::lock_guard<std::mutex> lock(mergeMutex);
+    frame.add(threadStats);
+    threadStats.clear();
+}
+
+StatsPause::StatsPause() : collected(threadStats)
+{
+    threadStats.clear();
+}
+
+StatsPause::~StatsPause()
+{
+    threadStats = collected;
+}
+
+const PipelineStats& StatsPause::counted() const
+{
+    return threadStats;
+}
+
+void PipelineStats::writeJson(FILE* out) const
+{
+    fprintf(out, "{\"triangles\": {\"submitted\": %lld, \"culled\": %lld, \"clipped\": %lld, \"rasterized\": %lld}, ",
+            trianglesSubmitted, trianglesCulled, trianglesClipped, trianglesRasterized);
+    fprintf(out, "\"pixels\": {\"tested\": %lld, \"covered\": %lld, \"depth_rejected\": %lld, \"shaded\": %lld, \"reused\": %lld, \"written\": %lld, \"depth_only\": %lld}, ",
+            pixelsTested, pixelsCovered, pixelsDepthRejected, pixelsShaded, pixelsReused, pixelsWritten, pixelsDepthOnly);
+    fprintf(out, "\"texture_fetches\": {");
+    for (int i = 0; i < TEXTURE_MAPS; i++) fprintf(out, "%s\"%s\": %lld", i ? ", " : "", MAP_NAMES[i], textureFetches[i]);
+    fprintf(out, "}, \"cycles\": {");
+    for (int i = 0; i < PIPELINE_STAGES; i++) fprintf(out, "%s\"%s\": %llu", i ? ", " : "", STAGE_NAMES[i], cycles[i]);
+    fprintf(out, "}}");
+}
+
+void PipelineStats::writeTable(FILE* out) const
+{
+    fprintf(out, "triangles  submitted %12lld  culled %12lld  clipped %10lld  rasterized %10lld\n",
+            trianglesSubmitted, trianglesCulled, trianglesClipped, trianglesRasterized);
+    fprintf(out, "pixels     tested    %12lld  covered %11lld  depth rejected %6lld  shaded %10lld  reused %10lld  written %10lld  depth only %10lld\n",
+            pixelsTested, pixelsCovered, pixelsDepthRejected, pixelsShaded, pixelsReused, pixelsWritten, pixelsDepthOnly);
+    fprintf(out, "textures  ");
+    for (int i = 0; i < TEXTURE_MAPS; i++) fprintf(out, " %-9s %12lld ", MAP_NAMES[i], textureFetches[i]);
+    fprintf(out, "\n");
+
+    unsigned long long total = 0;
+    for (int i = 0; i < PIPELINE_STAGES; i++) total += cycles[i];
+    fprintf(out, "cycles    ");
+    for (int i = 0; i < PIPELINE_STAGES; i++)
+    {
+        fprintf(out, " %-9s %12llu (%4.1f%%)", STAGE_NAMES[i], cycles[i], total ? 100. * cycles[i] / total : 0.);
+    }
+    fprintf(out, "\n");
+}
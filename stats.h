@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstdio>
+#include <chrono>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+enum PipelineStage { STAGE_VERTEX, STAGE_RASTER, STAGE_FRAGMENT, STAGE_PREPASS, PIPELINE_STAGES };
+enum TextureMap { DIFFUSE_MAP, NORMAL_MAP, SPECULAR_MAP, TEXTURE_MAPS };
+
+// the fragment stage reads the clock around one fragment in this many and
+// scales the result, the other stages are timed per triangle; the depth
+// pre-pass counts its vertices and rasterization as one stage
+const int FRAGMENT_TIMING_RATE = 16;
+
+// counters of the render pipeline. Each thread adds to its own copy,
+// threadStats, without any synchronisation; mergeThreadStats folds that copy
+// into a frame total once the thread is done with the frame.
+struct PipelineStats
+{
+    long long trianglesSubmitted;   // faces of the selected levels of detail
+    long long trianglesCulled;      // by meshlet bounds, or for having no area
+    long long trianglesClipped;     // dropped for reaching outside the guard band
+    long long trianglesRasterized;
+
+    long long pixelsTested;         // pixels of the bounding boxes walked
+    long long pixelsCovered;        // at least one sample inside the triangle
+    long long pixelsDepthRejected;  // covered, but every covered sample was behind
+    long long pixelsShaded;         // fragment() calls
+    long long pixelsReused;         // colors carried over from an earlier frame instead
+    long long pixelsWritten;        // fragments that were kept
+    long long pixelsDepthOnly;      // passed the depth pre-pass, what a single pass would have shaded
+
+    long long textureFetches[TEXTURE_MAPS];
+    unsigned long long cycles[PIPELINE_STAGES];
+
+    PipelineStats();
+    void clear();
+    void add(const PipelineStats& other);
+
+    void writeJson(FILE* out) const;
+    void writeTable(FILE* out) const;
+};
+
+extern thread_local PipelineStats threadStats;
+
+// adds the calling thread's counters to frame and resets them
+void mergeThreadStats(PipelineStats& frame);
+
+// Pauses the calling thread's collection for work that is not part of the
+// frame, such as drawing a reference image: while it lives the thread counts
+// into a fresh set, counted(), and its own counters are set aside untouched.
+class StatsPause
+{
+public:
+    StatsPause();
+    ~StatsPause();
+
+    StatsPause(const StatsPause&) = delete;
+    StatsPause& operator=(const StatsPause&) = delete;
+
+    // what the paused work added up to so far
+    const PipelineStats& counted() const;
+
+private:
+    PipelineStats collected;
+};
+
+// time stamp counter where there is one, only meant for differences
+inline unsigned long long cycleCount()
+{
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
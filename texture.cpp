@@ -0,0 +1,382 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include "texture.h"
+
+// decoded texels of one block, bgra; key 0 marks an empty slot
+struct DecodedBlock
+{
+    unsigned long long key;
+    unsigned char texels[16 * 4];
+};
+
+// 16 x 16 blocks, 64 x 64 texels around the last fetches of a thread
+const int BLOCK_CACHE_SIZE = 256;
+static thread_local DecodedBlock blockCache[BLOCK_CACHE_SIZE];
+
+static std::atomic<unsigned> nextId(1);
+
+// 565 to 888, rgb order
+static void unpack565(unsigned v, int* rgb)
+{
+    int r = (v >> 11) & 31, g = (v >> 5) & 63, b = v & 31;
+    rgb[0] = (r << 3) | (r >> 2);
+    rgb[1] = (g << 2) | (g >> 4);
+    rgb[2] = (b << 3) | (b >> 2);
+}
+
+static unsigned pack565(const float* rgb)
+{
+    int r = std::min(31, std::max(0, (int)(rgb[0] * 31 / 255 + .5f)));
+    int g = std::min(63, std::max(0, (int)(rgb[1] * 63 / 255 + .5f)));
+    int b = std::min(31, std::max(0, (int)(rgb[2] * 31 / 255 + .5f)));
+    return r << 11 | g << 5 | b;
+}
+
+// the colors of a BC1 block: the end points and two between them, or in
+// three color mode (c0 <= c1 when decoding) one between and black
+static void bc1Palette(unsigned c0, unsigned c1, bool fourColors, int palette[4][3])
+{
+    unpack565(c0, palette[0]);
+    unpack565(c1, palette[1]);
+    for (int i = 0; i < 3; i++)
+    {
+        if (fourColors)
+        {
+            palette[2][i] = (2 * palette[0][i] + palette[1][i]) / 3;
+            palette[3][i] = (palette[0][i] + 2 * palette[1][i]) / 3;
+        }
+        else
+        {
+            palette[2][i] = (palette[0][i] + palette[1][i]) / 2;
+            palette[3][i] = 0;
+        }
+    }
+}
+
+// picks the nearest four color mode palette entry for every texel and
+// returns the squared error
+static int bc1Indices(const unsigned char (*rgb)[3], unsigned c0, unsigned c1, unsigned& indices)
+{
+    int palette[4][3];
+    bc1Palette(c0, c1, true, palette);
+    indices = 0;
+    int total = 0;
+    for (int t = 0; t < 16; t++)
+    {
+        int best = 0, bestError = std::numeric_limits<int>::max();
+        for (int c = 0; c < 4; c++)
+        {
+            int error = 0;
+            for (int i = 0; i < 3; i++) error += (rgb[t][i] - palette[c][i]) * (rgb[t][i] - palette[c][i]);
+            if (error < bestError)
+            {
+                bestError = error;
+                best = c;
+            }
+        }
+        indices |= best << (2 * t);
+        total += bestError;
+    }
+    return total;
+}
+
+// end points along the principal axis of the block's colors, each texel
+// taking the nearest of the four palette colors
+static void encodeBc1(const unsigned char (*rgb)[3], unsigned char* out)
+{
+    float mean[3] = { 0, 0, 0 };
+    for (int t = 0; t < 16; t++)
+        for (int i = 0; i < 3; i++) mean[i] += rgb[t][i] / 16.f;
+
+    float cov[6] = { 0, 0, 0, 0, 0, 0 };
+    for (int t = 0; t < 16; t++)
+    {
+        float d[3] = { rgb[t][0] - mean[0], rgb[t][1] - mean[1], rgb[t][2] - mean[2] };
+        cov[0] += d[0] * d[0];
+        cov[1] += d[0] * d[1];
+        cov[2] += d[0] * d[2];
+        cov[3] += d[1] * d[1];
+        cov[4] += d[1] * d[2];
+        cov[5] += d[2] * d[2];
+    }
+    float axis[3] = { 1, 1, 1 };
+    for (int k = 0; k < 8; k++)
+    {
+        float a[3] = { cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2],
+                       cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2],
+                       cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2] };
+        float norm = std::max(std::max(std::abs(a[0]), std::abs(a[1])), std::abs(a[2]));
+        if (norm == 0) break;
+        for (int i = 0; i < 3; i++) axis[i] = a[i] / norm;
+    }
+
+    float lo = std::numeric_limits<float>::max(), hi = -lo;
+    for (int t = 0; t < 16; t++)
+    {
+        float p = (rgb[t][0] - mean[0]) * axis[0] + (rgb[t][1] - mean[1]) * axis[1] + (rgb[t][2] - mean[2]) * axis[2];
+        lo = std::min(lo, p);
+        hi = std::max(hi, p);
+    }
+    float e0[3], e1[3];
+    for (int i = 0; i < 3; i++)
+    {
+        e0[i] = mean[i] + axis[i] * hi;
+        e1[i] = mean[i] + axis[i] * lo;
+    }
+    unsigned c0 = pack565(e0), c1 = pack565(e1);
+    unsigned indices;
+    int error = bc1Indices(rgb, c0, c1, indices);
+
+    // least squares end points for the indices picked, while that helps
+    for (int k = 0; k < 2 && error; k++)
+    {
+        static const float WEIGHTS[4] = { 1.f, 0.f, 2.f / 3, 1.f / 3 };
+        float aa = 0, ab = 0, bb = 0, ax[3] = { 0, 0, 0 }, bx[3] = { 0, 0, 0 };
+        for (int t = 0; t < 16; t++)
+        {
+            float a = WEIGHTS[(indices >> (2 * t)) & 3], b = 1 - a;
+            aa += a * a;
+            ab += a * b;
+            bb += b * b;
+            for (int i = 0; i < 3; i++)
+            {
+                ax[i] += a * rgb[t][i];
+                bx[i] += b * rgb[t][i];
+            }
+        }
+        float det = aa * bb - ab * ab;
+        if (std::abs(det) < 1e-6f) break;
+        for (int i = 0; i < 3; i++)
+        {
+            e0[i] = (bb * ax[i] - ab * bx[i]) / det;
+            e1[i] = (aa * bx[i] - ab * ax[i]) / det;
+        }
+        unsigned n0 = pack565(e0), n1 = pack565(e1), nIndices;
+        int nError = bc1Indices(rgb, n0, n1, nIndices);
+        if (nError >= error) break;
+        c0 = n0;
+        c1 = n1;
+        indices = nIndices;
+        error = nError;
+    }
+
+    // four color mode needs c0 > c1; swapping the end points maps the
+    // indices 0 1 2 3 to 1 0 3 2
+    if (c0 < c1)
+    {
+        std::swap(c0, c1);
+        indices ^= 0x55555555;
+    }
+    if (c0 == c1) indices = 0;
+    out[0] = (unsigned char)c0;
+    out[1] = (unsigned char)(c0 >> 8);
+    out[2] = (unsigned char)c1;
+    out[3] = (unsigned char)(c1 >> 8);
+    for (int i = 0; i < 4; i++) out[4 + i] = (unsigned char)(indices >> (8 * i));
+}
+
+static void decodeBc1(const unsigned char* in, unsigned char* texels)
+{
+    unsigned c0 = in[0] | in[1] << 8, c1 = in[2] | in[3] << 8;
+    unsigned indices = in[4] | in[5] << 8 | in[6] << 16 | (unsigned)in[7] << 24;
+    int palette[4][3];
+    bc1Palette(c0, c1, c0 > c1, palette);
+    for (int t = 0; t < 16; t++, texels += 4)
+    {
+        const int* c = palette[(indices >> (2 * t)) & 3];
+        texels[0] = (unsigned char)c[2];
+        texels[1] = (unsigned char)c[1];
+        texels[2] = (unsigned char)c[0];
+        texels[3] = 255;
+    }
+}
+
+// the eight values of a BC4 block with v0 > v1, or six and 0 and 255
+static void bc4Palette(int v0, int v1, int palette[8])
+{
+    palette[0] = v0;
+    palette[1] = v1;
+    if (v0 > v1)
+    {
+        for (int i = 1; i < 7; i++) palette[i + 1] = ((7 - i) * v0 + i * v1) / 7;
+    }
+    else
+    {
+        for (int i = 1; i < 5; i++) palette[i + 1] = ((5 - i) * v0 + i * v1) / 5;
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+}
+
+static void encodeBc4(const unsigned char* values, unsigned char* out)
+{
+    int v0 = 0, v1 = 255;
+    for (int t = 0; t < 16; t++)
+    {
+        v0 = std::max(v0, (int)values[t]);
+        v1 = std::min(v1, (int)values[t]);
+    }
+    unsigned long long indices = 0;
+    if (v0 != v1)
+    {
+        int palette[8];
+        bc4Palette(v0, v1, palette);
+        for (int t = 0; t < 16; t++)
+        {
+            int best = 0;
+            for (int c = 1; c < 8; c++)
+            {
+                if (std::abs(values[t] - palette[c]) < std::abs(values[t] - palette[best])) best = c;
+            }
+            indices |= (unsigned long long)best << (3 * t);
+        }
+    }
+    out[0] = (unsigned char)v0;
+    out[1] = (unsigned char)v1;
+    for (int i = 0; i < 6; i++) out[2 + i] = (unsigned char)(indices >> (8 * i));
+}
+
+// writes the 16 values of a BC4 block to every stride-th byte of texels
+static void decodeBc4(const unsigned char* in, unsigned char* texels, int stride)
+{
+    int palette[8];
+    bc4Palette(in[0], in[1], palette);
+    unsigned long long indices = 0;
+    for (int i = 0; i < 6; i++) indices |= (unsigned long long)in[2 + i] << (8 * i);
+    for (int t = 0; t < 16; t++) texels[t * stride] = (unsigned char)palette[(indices >> (3 * t)) & 7];
+}
+
+BlockTexture::BlockTexture() : width(0), height(0), blocksX(0), blockBytes(0), format(BLOCK_BC1), id(0), blocks()
+{
+}
+
+double BlockTexture::encode(TGAImage& image, BlockFormat blockFormat)
+{
+    width = image.get_width();
+    height = image.get_height();
+    format = blockFormat;
+    blockBytes = format == BLOCK_BC5 ? 16 : 8;
+    blocksX = (width + 3) / 4;
+    int blocksY = (height + 3) / 4;
+    id = nextId++;
+    blocks.assign((size_t)blocksX * blocksY * blockBytes, 0);
+    if (!image.buffer() || width <= 0 || height <= 0) return 0;
+
+    // blocks reaching past the edge repeat the last row and column
+    int bytespp = image.get_bytespp();
+    int channels = format == BLOCK_BC1 ? 3 : format == BLOCK_BC4 ? 1 : 2;
+    double squared = 0;
+    for (int by = 0; by < blocksY; by++)
+    {
+        for (int bx = 0; bx < blocksX; bx++)
+        {
+            unsigned char source[16][4] = {};
+            for (int t = 0; t < 16; t++)
+            {
+                int x = std::min(bx * 4 + t % 4, width - 1);
+                int y = std::min(by * 4 + t / 4, height - 1);
+                memcpy(source[t], image.buffer() + ((size_t)y * width + x) * bytespp, bytespp);
+            }
+
+            unsigned char* block = &blocks[((size_t)by * blocksX + bx) * blockBytes];
+            if (format == BLOCK_BC1)
+            {
+                unsigned char rgb[16][3];
+                for (int t = 0; t < 16; t++)
+                {
+                    rgb[t][0] = source[t][2];
+                    rgb[t][1] = source[t][1];
+                    rgb[t][2] = source[t][0];
+                }
+                encodeBc1(rgb, block);
+            }
+            else
+            {
+                // BC4 keeps channel 0, BC5 red (2) and green (1)
+                unsigned char values[16];
+                for (int c = 0; c < channels; c++)
+                {
+                    int channel = format == BLOCK_BC4 ? 0 : 2 - c;
+                    for (int t = 0; t < 16; t++) values[t] = source[t][channel];
+                    encodeBc4(values, block + 8 * c);
+                }
+            }
+
+            unsigned char decoded[16 * 4];
+            decode(bx, by, decoded);
+            for (int t = 0; t < 16; t++)
+            {
+                if (bx * 4 + t % 4 >= width || by * 4 + t / 4 >= height) continue;
+                for (int c = 0; c < channels; c++)
+                {
+                    int channel = format == BLOCK_BC1 ? c : format == BLOCK_BC4 ? 0 : 2 - c;
+                    int d = decoded[t * 4 + channel] - source[t][channel];
+                    squared += d * d;
+                }
+            }
+        }
+    }
+    if (squared == 0) return std::numeric_limits<double>::infinity();
+    return 10 * std::log10(255. * 255. * width * height * channels / squared);
+}
+
+void BlockTexture::decode(int bx, int by, unsigned char* texels) const
+{
+    const unsigned char* block = &blocks[((size_t)by * blocksX + bx) * blockBytes];
+    if (format == BLOCK_BC1)
+    {
+        decodeBc1(block, texels);
+        return;
+    }
+    memset(texels, 0, 16 * 4);
+    if (format == BLOCK_BC4)
+    {
+        decodeBc4(block, texels, 4);
+        return;
+    }
+    decodeBc4(block, texels + 2, 4);
+    decodeBc4(block + 8, texels + 1, 4);
+}
+
+TGAColor BlockTexture::get(int x, int y) const
+{
+    if (x < 0 || y < 0 || x >= width || y >= height) return TGAColor();
+
+    int bx = x >> 2, by = y >> 2;
+    unsigned long long key = (unsigned long long)id << 32 | (unsigned)(by * blocksX + bx);
+    DecodedBlock& slot = blockCache[((bx & 15) | (by & 15) << 4) ^ (id * 37 & (BLOCK_CACHE_SIZE - 1))];
+    if (slot.key != key)
+    {
+        decode(bx, by, slot.texels);
+        slot.key = key;
+    }
+    return TGAColor(slot.texels + ((y & 3) * 4 + (x & 3)) * 4, format == BLOCK_BC4 ? 1 : 3);
+}
+
+int BlockTexture::get_width() const
+{
+    return width;
+}
+
+int BlockTexture::get_height() const
+{
+    return height;
+}
+
+bool BlockTexture::empty() const
+{
+    return blocks.empty();
+}
+
+size_t BlockTexture::bytes() const
+{
+    return blocks.size();
+}
+
+const unsigned char* BlockTexture::buffer() const
+{
+    return blocks.data();
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <vector>
+#include "tgaimage.h"
+
+// layouts of 4x4 texel blocks, as in the GPU formats of the same names
+enum BlockFormat
+{
+    BLOCK_BC1,  // rgb, two 565 end points and 2 bit indices, 8 bytes
+    BLOCK_BC4,  // one channel, two 8 bit end points and 3 bit indices, 8 bytes
+    BLOCK_BC5   // two BC4 blocks for the red and green channels, 16 bytes
+};
+
+// A texture kept block compressed in memory and decoded a block at a time
+// when sampled. Decoded blocks go to a small direct mapped cache per
+// thread, so neighbouring fetches decode once.
+class BlockTexture
+{
+public:
+    BlockTexture();
+
+    // compresses image, which may be released afterwards, and returns the
+    // PSNR in dB of the decoded texels against it over the kept channels;
+    // BC1 reads the color, BC4 channel 0 and BC5 red and green
+    double encode(TGAImage& image, BlockFormat blockFormat);
+
+    // texel x, y as TGAImage::get would return it: BC1 fills blue, green
+    // and red, BC4 channel 0, BC5 red and green; black outside the texture
+    TGAColor get(int x, int y) const;
+
+    // named as in TGAImage, so that samplers read either the same way
+    int get_width() const;
+    int get_height() const;
+    bool empty() const;
+    size_t bytes() const;
+    // the encoded blocks, bytes() of them
+    const unsigned char* buffer() const;
+
+private:
+    // decodes block bx, by into rgba texels
+    void decode(int bx, int by, unsigned char* texels) const;
+
+    int width;
+    int height;
+    int blocksX;
+    int blockBytes;
+    BlockFormat format;
+    unsigned id;    // tells the blocks of textures apart in the cache
+    std::vector<unsigned char> blocks;
+};
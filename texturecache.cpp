@@ -0,0 +1,283 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include "texturecache.h"
+#include "trace.h"
+
+TextureCache textureCache;
+
+// the murmur3 finalizer: every bit of x reaches every bit of the result
+static unsigned long long mix(unsigned long long x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return x;
+}
+
+// FNV-1a over the size and texels, a word at a time. The words are mixed
+// first: the multiply only carries bits upwards, so raw words that differ
+// in the same high bit would cancel out.
+static unsigned long long contentHash(TGAImage& image)
+{
+    const unsigned long long prime = 1099511628211ull;
+    unsigned long long h = 14695981039346656037ull;
+    h = (h ^ (unsigned)image.get_width()) * prime;
+    h = (h ^ (unsigned)image.get_height()) * prime;
+    h = (h ^ (unsigned)image.get_bytespp()) * prime;
+    size_t n = (size_t)image.get_width() * image.get_height() * image.get_bytespp();
+    const unsigned char* bytes = image.buffer();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        unsigned long long word;
+        memcpy(&word, bytes + i, 8);
+        h = (h ^ mix(word)) * prime;
+    }
+    for (; i < n; i++) h = (h ^ bytes[i]) * prime;
+    return h;
+}
+
+// mean absolute difference of every channel to the texel on the right and
+// the one above, as a fraction of the full range
+static float texelVariation(TGAImage& image)
+{
+    int width = image.get_width(), height = image.get_height(), bytespp = image.get_bytespp();
+    if (width < 2 || height < 2) return 0;
+    const unsigned char* texels = image.buffer();
+    size_t stride = (size_t)width * bytespp;
+    unsigned long long sum = 0;
+    for (int y = 0; y + 1 < height; y++)
+    {
+        const unsigned char* row = texels + y * stride;
+        for (size_t i = 0; i + bytespp < stride; i++)
+            sum += std::abs(row[i + bytespp] - row[i]) + std::abs(row[i + stride] - row[i]);
+    }
+    return (float)(sum / (2. * 255 * (height - 1) * (stride - bytespp)));
+}
+
+// whether two maps of the same format hold the same texels, or the same
+// blocks once compressed; equal hashes alone do not make them equal
+static bool sameTexels(CachedTexture& a, CachedTexture& b)
+{
+    if (!a.blocks.empty() || !b.blocks.empty())
+        return a.blocks.get_width() == b.blocks.get_width() && a.blocks.get_height() == b.blocks.get_height() &&
+               a.blocks.bytes() == b.blocks.bytes() && !memcmp(a.blocks.buffer(), b.blocks.buffer(), a.blocks.bytes());
+    if (a.image.get_width() != b.image.get_width() || a.image.get_height() != b.image.get_height() ||
+        a.image.get_bytespp() != b.image.get_bytespp())
+        return false;
+    size_t n = (size_t)a.image.get_width() * a.image.get_height() * a.image.get_bytespp();
+    return !memcmp(a.image.buffer(), b.image.buffer(), n);
+}
+
+TextureCache::TextureCache(size_t budget)
+    : budget(budget), mutex(), loaded(), queued(), paths(), contents(), unused(), prefetches(), stats(), stopping(false),
+      threads()
+{
+}
+
+TextureCache::~TextureCache()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    queued.notify_all();
+    for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+
+    std::vector<Entry*> entries;
+    for (std::map<std::string, Entry*>::iterator it = paths.begin(); it != paths.end(); ++it) entries.push_back(it->second);
+    std::sort(entries.begin(), entries.end());
+    entries.erase(std::unique(entries.begin(), entries.end()), entries.end());
+    for (size_t i = 0; i < entries.size(); i++) delete entries[i];
+}
+
+std::string TextureCache::key(const std::string& path, int format)
+{
+    return format == DECODED ? path : path + "#bc" + "145"[format];
+}
+
+TextureCache::Entry* TextureCache::load(const std::string& path, int format)
+{
+    Entry* entry = new Entry();
+    entry->format = format;
+    TGAImage& image = entry->image;
+    if (path.empty()) return entry; // a material without this map
+    {
+        TRACE_SCOPE("decode texture");
+        bool ok = image.read_tga_file(path.c_str(), true);
+        std::cerr << "texture file " << path << " loading " << (ok ? "ok" : "failed") << std::endl;
+        if (!ok) return entry;
+    }
+    entry->hash = contentHash(image);
+    entry->variation = texelVariation(image);
+    entry->bytes = (size_t)image.get_width() * image.get_height() * image.get_bytespp();
+    if (format == DECODED) return entry;
+
+    TRACE_SCOPE("compress texture");
+    double psnr = entry->blocks.encode(image, (BlockFormat)format);
+    std::cerr << "# texture bc" << "145"[format] << " " << image.get_width() << "x" << image.get_height() << " " << entry->bytes / 1024
+              << " KB -> " << entry->blocks.bytes() / 1024 << " KB, psnr " << psnr << " dB" << std::endl;
+    image = TGAImage();
+    entry->bytes = entry->blocks.bytes();
+    return entry;
+}
+
+TextureCache::Entry* TextureCache::insert(const std::string& key, Entry* loaded)
+{
+    stats.loads++;
+    std::pair<unsigned long long, int> content(loaded->hash, loaded->format);
+    std::map<std::pair<unsigned long long, int>, Entry*>::iterator same = contents.find(content);
+    if (loaded->bytes && same != contents.end() && sameTexels(*loaded, *same->second))
+    {
+        stats.duplicates++;
+        delete loaded;
+        loaded = same->second;
+    }
+    else
+    {
+        // files that could not be read are kept too, at no cost, so that
+        // they are not tried again until evicted; of two maps whose hashes
+        // collide, the first one stays the one others are matched against
+        if (loaded->bytes && same == contents.end()) contents[content] = loaded;
+        stats.bytes += loaded->bytes;
+        loaded->unused = unused.insert(unused.end(), loaded);
+    }
+    loaded->keys.push_back(key);
+    paths[key] = loaded;
+    this->loaded.notify_all();
+    return loaded;
+}
+
+void TextureCache::evict()
+{
+    while (stats.bytes > budget && !unused.empty())
+    {
+        Entry* entry = unused.front();
+        unused.pop_front();
+        for (size_t i = 0; i < entry->keys.size(); i++) paths.erase(entry->keys[i]);
+        std::map<std::pair<unsigned long long, int>, Entry*>::iterator it = contents.find(std::make_pair(entry->hash, entry->format));
+        if (it != contents.end() && it->second == entry) contents.erase(it);
+        stats.bytes -= entry->bytes;
+        stats.evictions++;
+        delete entry;
+    }
+}
+
+CachedTexture* TextureCache::acquire(const std::string& path, int format)
+{
+    std::string k = key(path, format);
+    std::unique_lock<std::mutex> lock(mutex);
+    Entry* entry = NULL;
+    for (;;)
+    {
+        std::map<std::string, Entry*>::iterator it = paths.find(k);
+        if (it == paths.end()) break;
+        if (it->second)
+        {
+            entry = it->second;
+            stats.hits++;
+            break;
+        }
+        loaded.wait(lock);
+    }
+    if (!entry)
+    {
+        paths[k] = NULL;
+        lock.unlock();
+        Entry* read = load(path, format);
+        lock.lock();
+        entry = insert(k, read);
+    }
+    if (entry->prefetched) entry->prefetched = false;
+    else if (entry->refs == 0) unused.erase(entry->unused);
+    entry->refs++;
+    evict();
+    return entry;
+}
+
+void TextureCache::release(CachedTexture* texture)
+{
+    if (!texture) return;
+    Entry* entry = static_cast<Entry*>(texture);
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--entry->refs == 0) entry->unused = unused.insert(unused.end(), entry);
+    evict();
+}
+
+void TextureCache::prefetch(const std::string& path, int format)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (paths.count(key(path, format))) return;
+    prefetches.push_back(std::make_pair(path, format));
+    while ((int)threads.size() < PREFETCH_THREADS) threads.push_back(std::thread(&TextureCache::run, this));
+    queued.notify_one();
+}
+
+void TextureCache::cancelPrefetch(const std::string& path, int format)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    std::deque<std::pair<std::string, int> >::iterator queuedAt =
+        std::find(prefetches.begin(), prefetches.end(), std::make_pair(path, format));
+    if (queuedAt != prefetches.end())
+    {
+        prefetches.erase(queuedAt);
+        stats.cancelled++;
+        return;
+    }
+    std::string k = key(path, format);
+    std::map<std::string, Entry*>::iterator it;
+    while ((it = paths.find(k)) != paths.end() && !it->second) loaded.wait(lock);
+    if (it == paths.end() || !it->second->prefetched) return;
+    Entry* entry = it->second;
+    entry->prefetched = false;
+    entry->unused = unused.insert(unused.end(), entry);
+    stats.cancelled++;
+    evict();
+}
+
+void TextureCache::setBudget(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    budget = bytes;
+    evict();
+}
+
+TextureCache::Counters TextureCache::counters()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
+
+void TextureCache::run()
+{
+    traceThreadRole("prefetch");
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;)
+    {
+        while (prefetches.empty() && !stopping) queued.wait(lock);
+        if (stopping) return;
+        std::pair<std::string, int> next = prefetches.front();
+        prefetches.pop_front();
+        std::string k = key(next.first, next.second);
+        if (paths.count(k)) continue;
+
+        paths[k] = NULL;
+        lock.unlock();
+        Entry* read = load(next.first, next.second);
+        lock.lock();
+        // kept out of unused until acquired, or the budget would have it
+        // evicted before the model that asked for it gets to it
+        Entry* entry = insert(k, read);
+        if (entry->refs == 0 && !entry->prefetched)
+        {
+            unused.erase(entry->unused);
+            entry->prefetched = true;
+        }
+        evict();
+        if (entry->prefetched && stats.bytes > budget) stats.held++;
+    }
+}
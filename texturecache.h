@@ -0,0 +1,111 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "tgaimage.h"
+#include "texture.h"
+
+// a map as the samplers read it: the decoded image, or its block compressed
+// copy when blocks is not empty, the image being empty then
+struct CachedTexture
+{
+    CachedTexture() : image(), blocks(), variation(0) {}
+
+    TGAImage image;
+    BlockTexture blocks;
+    float variation;    // mean difference between neighbouring texels, 0 to 1
+};
+
+// Process wide store of the texture maps of every model. A map is read once
+// per path and format, and files holding the same texels share one copy.
+// The copy lasts until the last release(); maps nobody holds then stay
+// loaded, least recently released leaving first, while the loaded maps take
+// more bytes than the budget. Maps in use are never evicted, so the budget
+// is exceeded while they alone exceed it; nor are prefetched maps before
+// their first acquire(), so that they are not read twice. Safe to use from
+// several threads.
+class TextureCache
+{
+public:
+    // the format of maps kept as decoded images, for acquire() and prefetch()
+    static const int DECODED = -1;
+    // a model reads three maps at once
+    static const int PREFETCH_THREADS = 3;
+
+    explicit TextureCache(size_t budget = 256 << 20);
+    ~TextureCache();
+
+    TextureCache(const TextureCache&) = delete;
+    TextureCache& operator=(const TextureCache&) = delete;
+
+    // the map in path with its rows bottom first, and block
+    // compressed when format is a BlockFormat; it is read now unless loaded
+    // or being prefetched, and is empty when the file cannot be read. The
+    // map is shared and must not be changed; hand it back to release()
+    CachedTexture* acquire(const std::string& path, int format = DECODED);
+    void release(CachedTexture* texture);
+    // reads the map on one of PREFETCH_THREADS background threads, so that
+    // its acquire() finds it or waits for less; the map is kept until then
+    void prefetch(const std::string& path, int format = DECODED);
+    // for a prefetched map that will not be acquired after all: it leaves
+    // the queue, or may be evicted once read like a map nobody holds
+    void cancelPrefetch(const std::string& path, int format = DECODED);
+
+    void setBudget(size_t bytes);
+
+    struct Counters
+    {
+        long long hits;       // acquires that found the map loaded or loading
+        long long loads;      // files read
+        long long duplicates; // files read that matched the texels of a loaded map
+        long long evictions;
+        long long held;       // prefetched maps kept over the budget until their acquire
+        long long cancelled;  // prefetched maps no acquire came for
+        size_t bytes;         // held by the loaded maps
+    };
+    Counters counters();
+
+private:
+    struct Entry : CachedTexture
+    {
+        Entry() : CachedTexture(), keys(), hash(0), format(DECODED), bytes(0), refs(0), prefetched(false), unused() {}
+
+        std::vector<std::string> keys;      // every path and format leading here
+        unsigned long long hash;            // of the decoded texels
+        int format;
+        size_t bytes;
+        int refs;
+        bool prefetched;                    // not acquired since, and kept out of unused
+        std::list<Entry*>::iterator unused; // position in unused while refs is 0 and not prefetched
+    };
+
+    static std::string key(const std::string& path, int format);
+    static Entry* load(const std::string& path, int format);
+    // makes loaded the map of key, or the loaded map with the same texels;
+    // the caller holds the mutex
+    Entry* insert(const std::string& key, Entry* loaded);
+    void evict();
+    void run();
+
+    size_t budget;
+    std::mutex mutex;
+    std::condition_variable loaded;           // a map of paths is ready
+    std::condition_variable queued;           // for the prefetch threads
+    std::map<std::string, Entry*> paths;      // NULL while being read
+    std::map<std::pair<unsigned long long, int>, Entry*> contents;
+    std::list<Entry*> unused;                 // least recently released first
+    std::deque<std::pair<std::string, int> > prefetches;
+    Counters stats;
+    bool stopping;
+    std::vector<std::thread> threads;         // started by the first prefetch()
+};
+
+// the maps of every Model
+extern TextureCache textureCache;
@@ -3,42 +3,50 @@
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
 #include "tgaimage.h"
+#include "aligned.h"
+
+static unsigned char *alloc_pixels(unsigned long nbytes) {
+    return (unsigned char *)alignedAlloc(nbytes);
+}
 
 TGAImage::TGAImage() : data(NULL), width(0), height(0), bytespp(0) {
 }
 
 TGAImage::TGAImage(int w, int h, int bpp) : data(NULL), width(w), height(h), bytespp(bpp) {
     unsigned long nbytes = width*height*bytespp;
-    data = new unsigned char[nbytes];
+    data = alloc_pixels(nbytes);
     memset(data, 0, nbytes);
 }
 
 TGAImage::TGAImage(const TGAImage &img) : data(NULL), width(img.width), height(img.height), bytespp(img.bytespp) {
     unsigned long nbytes = width*height*bytespp;
-    data = new unsigned char[nbytes];
+    data = alloc_pixels(nbytes);
     memcpy(data, img.data, nbytes);
 }
 
 TGAImage::~TGAImage() {
-    if (data) delete [] data;
+    alignedFree(data);
 }
 
 TGAImage & TGAImage::operator =(const TGAImage &img) {
     if (this != &img) {
-        if (data) delete [] data;
+        alignedFree(data);
         width  = img.width;
         height = img.height;
         bytespp = img.bytespp;
         unsigned long nbytes = width*height*bytespp;
-        data = new unsigned char[nbytes];
+        data = alloc_pixels(nbytes);
         memcpy(data, img.data, nbytes);
     }
     return *this;
 }
 
-bool TGAImage::read_tga_file(const char *filename) {
-    if (data) delete [] data;
+bool TGAImage::read_tga_file(const char *filename, bool bottom_up) {
+    alignedFree(data);
     data = NULL;
     std::ifstream in;
     in.open (filename, std::ios::binary);
@@ -62,17 +70,21 @@ bool TGAImage::read_tga_file(const char *filename) {
         std::cerr << "bad bpp (or width/height) value\n";
         return false;
     }
+    // files are bottom first unless the origin bit says top first
+    bool reverse_rows = !(header.imagedescriptor & 0x20) != bottom_up;
     unsigned long nbytes = bytespp*width*height;
-    data = new unsigned char[nbytes];
+    data = alloc_pixels(nbytes);
     if (3==header.datatypecode || 2==header.datatypecode) {
-        in.read((char *)data, nbytes);
+        unsigned long rowbytes = bytespp*width;
+        for (int y=0; y<height && in.good(); y++)
+            in.read((char *)data + (reverse_rows ? height-1-y : y)*rowbytes, rowbytes);
         if (!in.good()) {
             in.close();
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
     } else if (10==header.datatypecode||11==header.datatypecode) {
-        if (!load_rle_data(in)) {
+        if (!load_rle_data(in, reverse_rows)) {
             in.close();
             std::cerr << "an error occured while reading the data\n";
             return false;
@@ -82,9 +94,6 @@ bool TGAImage::read_tga_file(const char *filename) {
         std::cerr << "unknown file format " << (int)header.datatypecode << "\n";
         return false;
     }
-    if (!(header.imagedescriptor & 0x20)) {
-        flip_vertically();
-    }
     if (header.imagedescriptor & 0x10) {
         flip_horizontally();
     }
@@ -93,59 +102,83 @@ bool TGAImage::read_tga_file(const char *filename) {
     return true;
 }
 
-bool TGAImage::load_rle_data(std::ifstream &in) {
-    unsigned long pixelcount = width*height;
-    unsigned long currentpixel = 0;
-    unsigned long currentbyte  = 0;
-    TGAColor colorbuffer;
-    do {
-        unsigned char chunkheader = 0;
-        chunkheader = in.get();
-        if (!in.good()) {
+// decodes the packets from the rest of the file read at once; pixels go to
+// the rows in final order, so a packet running over the end of a row
+// continues at the start of the next row stored
+bool TGAImage::load_rle_data(std::ifstream &in, bool reverse_rows) {
+    std::streampos start = in.tellg();
+    in.seekg(0, std::ios::end);
+    std::vector<unsigned char> packets((size_t)(in.tellg()-start));
+    in.seekg(start);
+    in.read((char *)packets.data(), packets.size());
+    if (in.bad()) {
+        std::cerr << "an error occured while reading the data\n";
+        return false;
+    }
+    const unsigned char *src = packets.data(), *end = src + packets.size();
+    unsigned long rowbytes = bytespp*width;
+    int y = 0, x = 0;
+    unsigned char *row = data + (reverse_rows ? height-1 : 0)*rowbytes;
+    while (y<height) {
+        if (src>=end) {
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
-        if (chunkheader<128) {
-            chunkheader++;
-            for (int i=0; i<chunkheader; i++) {
-                in.read((char *)colorbuffer.bgra, bytespp);
-                if (!in.good()) {
-                    std::cerr << "an error occured while reading the header\n";
-                    return false;
-                }
-                for (int t=0; t<bytespp; t++)
-                    data[currentbyte++] = colorbuffer.bgra[t];
-                currentpixel++;
-                if (currentpixel>pixelcount) {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
-                }
-            }
-        } else {
-            chunkheader -= 127;
-            in.read((char *)colorbuffer.bgra, bytespp);
-            if (!in.good()) {
-                std::cerr << "an error occured while reading the header\n";
+        unsigned char chunkheader = *src++;
+        bool repeat = chunkheader>=128;
+        int count = repeat ? chunkheader-127 : chunkheader+1;
+        if (src + (repeat ? 1 : count)*bytespp > end) {
+            std::cerr << "an error occured while reading the header\n";
+            return false;
+        }
+        for (int i=0; i<count; i++) {
+            if (y>=height) {
+                std::cerr << "Too many pixels read\n";
                 return false;
             }
-            for (int i=0; i<chunkheader; i++) {
-                for (int t=0; t<bytespp; t++)
-                    data[currentbyte++] = colorbuffer.bgra[t];
-                currentpixel++;
-                if (currentpixel>pixelcount) {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
-                }
+            memcpy(row + x*bytespp, src, bytespp);
+            if (!repeat) src += bytespp;
+            if (++x==width) {
+                x = 0;
+                if (++y<height) row = data + (reverse_rows ? height-1-y : y)*rowbytes;
             }
         }
-    } while (currentpixel < pixelcount);
+        if (repeat) src += bytespp;
+    }
+    return true;
+}
+
+static bool write_header(std::ostream &out, int width, int height, int bytespp, bool rle, char imagedescriptor) {
+    TGA_Header header;
+    memset((void *)&header, 0, sizeof(header));
+    header.bitsperpixel = bytespp<<3;
+    header.width  = width;
+    header.height = height;
+    header.datatypecode = (bytespp==TGAImage::GRAYSCALE?(rle?11:3):(rle?10:2));
+    header.imagedescriptor = imagedescriptor;
+    out.write((char *)&header, sizeof(header));
+    if (!out.good()) {
+        std::cerr << "can't dump the tga file\n";
+        return false;
+    }
     return true;
 }
 
-bool TGAImage::write_tga_file(const char *filename, bool rle) {
+static bool write_footer(std::ostream &out) {
     unsigned char developer_area_ref[4] = {0, 0, 0, 0};
     unsigned char extension_area_ref[4] = {0, 0, 0, 0};
     unsigned char footer[18] = {'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0'};
+    out.write((char *)developer_area_ref, sizeof(developer_area_ref));
+    out.write((char *)extension_area_ref, sizeof(extension_area_ref));
+    out.write((char *)footer, sizeof(footer));
+    if (!out.good()) {
+        std::cerr << "can't dump the tga file\n";
+        return false;
+    }
+    return true;
+}
+
+bool TGAImage::write_tga_file(const char *filename, bool rle, bool bottom_up, int threads) {
     std::ofstream out;
     out.open (filename, std::ios::binary);
     if (!out.is_open()) {
@@ -153,96 +186,91 @@ bool TGAImage::write_tga_file(const char *filename, bool rle) {
         out.close();
         return false;
     }
-    TGA_Header header;
-    memset((void *)&header, 0, sizeof(header));
-    header.bitsperpixel = bytespp<<3;
-    header.width  = width;
-    header.height = height;
-    header.datatypecode = (bytespp==GRAYSCALE?(rle?11:3):(rle?10:2));
-    header.imagedescriptor = 0x20; // top-left origin
-    out.write((char *)&header, sizeof(header));
-    if (!out.good()) {
-        out.close();
-        std::cerr << "can't dump the tga file\n";
+    bool ok = write_tga(out, rle, bottom_up, threads);
+    out.close();
+    return ok;
+}
+
+bool TGAImage::write_tga(std::ostream &out, bool rle, bool bottom_up, int threads) {
+    if (!write_header(out, width, height, bytespp, rle, bottom_up ? 0x00 : 0x20)) {
         return false;
     }
     if (!rle) {
         out.write((char *)data, width*height*bytespp);
         if (!out.good()) {
             std::cerr << "can't unload raw data\n";
-            out.close();
             return false;
         }
     } else {
-        if (!unload_rle_data(out)) {
-            out.close();
+        if (!unload_rle_data(out, threads)) {
             std::cerr << "can't unload rle data\n";
             return false;
         }
     }
-    out.write((char *)developer_area_ref, sizeof(developer_area_ref));
-    if (!out.good()) {
-        std::cerr << "can't dump the tga file\n";
-        out.close();
-        return false;
+    return write_footer(out);
+}
+
+// RLE packets never cross a scanline, as the TGA 2.0 spec asks, so that any
+// band of rows encodes on its own. A raw packet ends where two equal pixels
+// could start a run.
+static void encode_rle_rows(const unsigned char *data, int width, int nrows, int bytespp, std::vector<unsigned char> &out) {
+    const int max_chunk_length = 128;
+    out.clear();
+    out.reserve((size_t)nrows*(width*bytespp + width/max_chunk_length + 1));
+    for (int y=0; y<nrows; y++) {
+        const unsigned char *row = data + (size_t)y*width*bytespp;
+        int curpix = 0;
+        while (curpix<width) {
+            const unsigned char *p = row + curpix*bytespp;
+            int left = width-curpix;
+            int run_length = 1;
+            if (left>1 && !memcmp(p, p+bytespp, bytespp)) {
+                while (run_length<left && run_length<max_chunk_length && !memcmp(p, p+run_length*bytespp, bytespp)) {
+                    run_length++;
+                }
+                out.push_back((unsigned char)(run_length+127));
+                out.insert(out.end(), p, p+bytespp);
+            } else {
+                while (run_length<left && run_length<max_chunk_length &&
+                       (run_length+1==left || memcmp(p+run_length*bytespp, p+(run_length+1)*bytespp, bytespp))) {
+                    run_length++;
+                }
+                out.push_back((unsigned char)(run_length-1));
+                out.insert(out.end(), p, p+run_length*bytespp);
+            }
+            curpix += run_length;
+        }
     }
-    out.write((char *)extension_area_ref, sizeof(extension_area_ref));
-    if (!out.good()) {
-        std::cerr << "can't dump the tga file\n";
-        out.close();
-        return false;
+}
+
+// encodes bands of rows on up to threads threads and writes them in order
+static bool write_rle_data(std::ostream &out, const unsigned char *data, int width, int height, int bytespp, int threads) {
+    threads = std::max(1, std::min(threads, height));
+    std::vector<std::vector<unsigned char> > chunks(threads);
+    std::vector<std::thread> workers;
+    size_t rowbytes = (size_t)width*bytespp;
+    for (int t=0; t<threads; t++) {
+        int y0 = (int)((long long)height*t/threads);
+        int y1 = (int)((long long)height*(t+1)/threads);
+        if (t+1<threads) {
+            workers.push_back(std::thread(encode_rle_rows, data+y0*rowbytes, width, y1-y0, bytespp, std::ref(chunks[t])));
+        } else {
+            encode_rle_rows(data+y0*rowbytes, width, y1-y0, bytespp, chunks[t]);
+        }
+    }
+    for (size_t t=0; t<workers.size(); t++) workers[t].join();
+    for (int t=0; t<threads; t++) {
+        out.write((char *)chunks[t].data(), chunks[t].size());
     }
-    out.write((char *)footer, sizeof(footer));
     if (!out.good()) {
         std::cerr << "can't dump the tga file\n";
-        out.close();
         return false;
     }
-    out.close();
     return true;
 }
 
-// TODO: it is not necessary to break a raw chunk for two equal pixels (for the matter of the resulting size)
-bool TGAImage::unload_rle_data(std::ofstream &out) {
-    const unsigned char max_chunk_length = 128;
-    unsigned long npixels = width*height;
-    unsigned long curpix = 0;
-    while (curpix<npixels) {
-        unsigned long chunkstart = curpix*bytespp;
-        unsigned long curbyte = curpix*bytespp;
-        unsigned char run_length = 1;
-        bool raw = true;
-        while (curpix+run_length<npixels && run_length<max_chunk_length) {
-            bool succ_eq = true;
-            for (int t=0; succ_eq && t<bytespp; t++) {
-                succ_eq = (data[curbyte+t]==data[curbyte+t+bytespp]);
-            }
-            curbyte += bytespp;
-            if (1==run_length) {
-                raw = !succ_eq;
-            }
-            if (raw && succ_eq) {
-                run_length--;
-                break;
-            }
-            if (!raw && !succ_eq) {
-                break;
-            }
-            run_length++;
-        }
-        curpix += run_length;
-        out.put(raw?run_length-1:run_length+127);
-        if (!out.good()) {
-            std::cerr << "can't dump the tga file\n";
-            return false;
-        }
-        out.write((char *)(data+chunkstart), (raw?run_length*bytespp:bytespp));
-        if (!out.good()) {
-            std::cerr << "can't dump the tga file\n";
-            return false;
-        }
-    }
-    return true;
+bool TGAImage::unload_rle_data(std::ostream &out, int threads) {
+    return write_rle_data(out, data, width, height, bytespp, threads);
 }
 
 TGAColor TGAImage::get(int x, int y) {
@@ -318,9 +346,9 @@ void TGAImage::clear() {
     memset((void *)data, 0, width*height*bytespp);
 }
 
-bool TGAImage::scale(int w, int h) {
-    if (w<=0 || h<=0 || !data) return false;
-    unsigned char *tdata = new unsigned char[w*h*bytespp];
+// nearest pixel resampling of the width x height pixels of data into the
+// w x h pixels of tdata
+static void resample(const unsigned char *data, int width, int height, unsigned char *tdata, int w, int h, int bytespp) {
     int nscanline = 0;
     int oscanline = 0;
     int erry = 0;
@@ -348,10 +376,65 @@ bool TGAImage::scale(int w, int h) {
             nscanline += nlinebytes;
         }
     }
-    delete [] data;
+}
+
+bool TGAImage::scale(int w, int h) {
+    if (w<=0 || h<=0 || !data) return false;
+    unsigned char *tdata = alloc_pixels(w*h*bytespp);
+    resample(data, width, height, tdata, w, h, bytespp);
+    alignedFree(data);
     data = tdata;
     width = w;
     height = h;
     return true;
 }
 
+bool TGAImage::scale(TGAImage &dst) {
+    if (!data || !dst.data || dst.bytespp!=bytespp) return false;
+    resample(data, width, height, dst.data, dst.width, dst.height, bytespp);
+    return true;
+}
+
+TGAStream::TGAStream() : out(), width(0), height(0), bytespp(0), rows(0), rle(true) {
+}
+
+bool TGAStream::open(const char *filename, int w, int h, int bpp, bool use_rle) {
+    width = w;
+    height = h;
+    bytespp = bpp;
+    rows = 0;
+    rle = use_rle;
+    out.open (filename, std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "can't open file " << filename << "\n";
+        return false;
+    }
+    return write_header(out, width, height, bytespp, rle, 0x00); // bottom-left origin
+}
+
+bool TGAStream::write_rows(TGAImage &band, int nrows) {
+    if (band.get_width()!=width || band.get_bytespp()!=bytespp || nrows>band.get_height() || rows+nrows>height) {
+        std::cerr << "band does not fit the tga stream\n";
+        return false;
+    }
+    if (rle) {
+        if (!write_rle_data(out, band.buffer(), width, nrows, bytespp, 1)) return false;
+    } else {
+        out.write((char *)band.buffer(), (std::streamsize)width*nrows*bytespp);
+        if (!out.good()) {
+            std::cerr << "can't unload raw data\n";
+            return false;
+        }
+    }
+    rows += nrows;
+    return true;
+}
+
+bool TGAStream::close() {
+    if (!out.is_open()) return false;
+    bool ok = rows==height;
+    if (!ok) std::cerr << "tga stream closed after " << rows << " of " << height << " rows\n";
+    ok = write_footer(out) && ok;
+    out.close();
+    return ok;
+}
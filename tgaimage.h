@@ -70,8 +70,8 @@ protected:
     int height;
     int bytespp;
 
-    bool   load_rle_data(std::ifstream &in);
-    bool unload_rle_data(std::ofstream &out);
+    bool   load_rle_data(std::ifstream &in, bool reverse_rows);
+    bool unload_rle_data(std::ostream &out, int threads);
 public:
     enum Format {
         GRAYSCALE=1, RGB=3, RGBA=4
@@ -80,11 +80,21 @@ public:
     TGAImage();
     TGAImage(int w, int h, int bpp);
     TGAImage(const TGAImage &img);
-    bool read_tga_file(const char *filename);
-    bool write_tga_file(const char *filename, bool rle=true);
+    // bottom_up stores the rows bottom first, the order the renderer samples
+    // them in, as they are decoded instead of in a flip_vertically() after
+    bool read_tga_file(const char *filename, bool bottom_up=false);
+    // bottom_up writes the rows as they are and marks the file's origin as
+    // bottom-left, which saves a flip_vertically(); threads > 1 encodes bands
+    // of scanlines in parallel
+    bool write_tga_file(const char *filename, bool rle=true, bool bottom_up=false, int threads=1);
+    // the same file written to out, e.g. a std::ostringstream
+    bool write_tga(std::ostream &out, bool rle=true, bool bottom_up=false, int threads=1);
     bool flip_horizontally();
     bool flip_vertically();
     bool scale(int w, int h);
+    // scales into dst, at its size, leaving this image as it is; the
+    // bytes per pixel must match
+    bool scale(TGAImage &dst);
     TGAColor get(int x, int y);
     bool set(int x, int y, TGAColor &c);
     bool set(int x, int y, const TGAColor &c);
@@ -97,5 +107,24 @@ public:
     void clear();
 };
 
+// Writes a TGA file a band of rows at a time, bottom row first (the file
+// says its origin is bottom-left), so that a render never has to hold or
+// flip the whole image.
+class TGAStream {
+    std::ofstream out;
+    int width;
+    int height;
+    int bytespp;
+    int rows;
+    bool rle;
+public:
+    TGAStream();
+    bool open(const char *filename, int w, int h, int bpp, bool use_rle=true);
+    // appends the first nrows rows of band, which must be as wide as the image
+    bool write_rows(TGAImage &band, int nrows);
+    // fails unless every row of the image was written
+    bool close();
+};
+
 #endif //__IMAGE_H__
 
@@ -0,0 +1,148 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "tiles.h"
+#include "trace.h"
+
+TileCache::TileCache(int width, int height, Vec3f lightDir)
+    : width(width), height(height), tilesX((width + TILE_SIZE - 1) / TILE_SIZE), tilesY((height + TILE_SIZE - 1) / TILE_SIZE),
+      light(lightDir), tiles(tilesX * tilesY), bounds()
+{
+}
+
+int TileCache::ntiles() const
+{
+    return tilesX * tilesY;
+}
+
+void TileCache::setTransform(const Instance& instance)
+{
+    model = instance.model;
+    modelView(instance.location, instance.rotation);
+    setUniforms(light);
+}
+
+// tiles under the projected bounding box of the model's bounding sphere, all
+// of them when part of the box is behind the camera
+TileCache::TileRect TileCache::tileBounds(const Instance& instance)
+{
+    setTransform(instance);
+    Vec3f c = model->center();
+    float r = model->radius();
+    float xmin = std::numeric_limits<float>::max(), ymin = xmin;
+    float xmax = -xmin, ymax = -xmin;
+    for (int i = 0; i < 8; i++)
+    {
+        Vec3f corner(c.x + (i & 1 ? r : -r), c.y + (i & 2 ? r : -r), c.z + (i & 4 ? r : -r));
+        Vec4f p = uniforms.mvp * embed<4>(corner);
+        if (p[3] >= 0)
+        {
+            TileRect all = { 0, 0, tilesX, tilesY };
+            return all;
+        }
+        xmin = std::min(xmin, p[0] / p[3]);
+        xmax = std::max(xmax, p[0] / p[3]);
+        ymin = std::min(ymin, p[1] / p[3]);
+        ymax = std::max(ymax, p[1] / p[3]);
+    }
+
+    // a pixel of margin for the sample positions
+    TileRect rect;
+    rect.x0 = (int)std::max(0.f, std::floor((xmin - 1) / TILE_SIZE));
+    rect.y0 = (int)std::max(0.f, std::floor((ymin - 1) / TILE_SIZE));
+    rect.x1 = (int)std::min((float)tilesX, std::floor((xmax + 1) / TILE_SIZE) + 1);
+    rect.y1 = (int)std::min((float)tilesY, std::floor((ymax + 1) / TILE_SIZE) + 1);
+    if (rect.x1 <= rect.x0 || rect.y1 <= rect.y0) rect.x0 = rect.y0 = rect.x1 = rect.y1 = 0;
+    return rect;
+}
+
+void TileCache::draw(const Instance& instance, TGAImage& image, zbuffer& zbuffer)
+{
+    setTransform(instance);
+    drawModel(*instance.shader, image, zbuffer, NULL);
+}
+
+void TileCache::render(const std::vector<Instance>& instances, TGAImage& image, zbuffer& zbuffer)
+{
+    TRACE_SCOPE("render tiles");
+    viewport(width, height);
+    for (size_t t = 0; t < tiles.size(); t++) tiles[t].clear();
+    bounds.resize(instances.size());
+    for (size_t i = 0; i < instances.size(); i++)
+    {
+        bounds[i] = tileBounds(instances[i]);
+        for (int y = bounds[i].y0; y < bounds[i].y1; y++)
+            for (int x = bounds[i].x0; x < bounds[i].x1; x++) tiles[x + y * tilesX].push_back((int)i);
+    }
+
+    image.clear();
+    zbuffer.clear();
+    for (size_t i = 0; i < instances.size(); i++) draw(instances[i], image, zbuffer);
+}
+
+int TileCache::update(const std::vector<Instance>& instances, const std::vector<int>& moved, TGAImage& image, zbuffer& zbuffer)
+{
+    TRACE_SCOPE("update tiles");
+    viewport(width, height);
+    std::vector<char> dirty(tiles.size(), 0);
+    for (size_t m = 0; m < moved.size(); m++)
+    {
+        int i = moved[m];
+        TileRect& rect = bounds[i];
+        for (int y = rect.y0; y < rect.y1; y++)
+            for (int x = rect.x0; x < rect.x1; x++)
+            {
+                std::vector<int>& list = tiles[x + y * tilesX];
+                list.erase(std::find(list.begin(), list.end(), i));
+                dirty[x + y * tilesX] = 1;
+            }
+
+        rect = tileBounds(instances[i]);
+        for (int y = rect.y0; y < rect.y1; y++)
+            for (int x = rect.x0; x < rect.x1; x++)
+            {
+                std::vector<int>& list = tiles[x + y * tilesX];
+                list.insert(std::lower_bound(list.begin(), list.end(), i), i);
+                dirty[x + y * tilesX] = 1;
+            }
+    }
+
+    // dirty tiles are redrawn in runs along each row of tiles, with every
+    // instance touching the run drawn in the original order so that depth
+    // ties resolve exactly as in a full render
+    int drawn = 0;
+    std::vector<int> touching;
+    for (int ty = 0; ty < tilesY; ty++)
+    {
+        for (int tx = 0; tx < tilesX; tx++)
+        {
+            if (!dirty[tx + ty * tilesX]) continue;
+            int end = tx;
+            touching.clear();
+            for (; end < tilesX && dirty[end + ty * tilesX]; end++)
+            {
+                const std::vector<int>& list = tiles[end + ty * tilesX];
+                touching.insert(touching.end(), list.begin(), list.end());
+            }
+            std::sort(touching.begin(), touching.end());
+            touching.erase(std::unique(touching.begin(), touching.end()), touching.end());
+            drawn += end - tx;
+
+            int x0 = tx * TILE_SIZE, x1 = std::min(width, end * TILE_SIZE);
+            int y0 = ty * TILE_SIZE, y1 = std::min(height, (ty + 1) * TILE_SIZE);
+            int bytespp = image.get_bytespp();
+            for (int y = y0; y < y1; y++) memset(image.buffer() + ((size_t)y * width + x0) * bytespp, 0, (size_t)(x1 - x0) * bytespp);
+            zbuffer.clearRect(x0, y0, x1, y1);
+
+            for (size_t k = 0; k < touching.size(); k++)
+            {
+                viewport(width, height);
+                scissor(x0, y0, x1, y1);
+                draw(instances[touching[k]], image, zbuffer);
+            }
+            tx = end - 1;
+        }
+    }
+    viewport(width, height);
+    return drawn;
+}
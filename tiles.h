@@ -0,0 +1,51 @@
+#pragma once
+
+#include <vector>
+#include "render.h"
+
+const int TILE_SIZE = 32;
+
+// a model drawn with its own transform
+struct Instance
+{
+    Model* model;
+    IShader* shader;
+    Vec3f location;
+    Vec3f rotation;
+};
+
+// Keeps, for every TILE_SIZE square of the image, the instances whose screen
+// bounds touch it, so that when some instances move only the tiles under
+// their old and new bounds are cleared and drawn again. The camera, the
+// light and the image size must stay the same between render() and update().
+class TileCache
+{
+public:
+    TileCache(int width, int height, Vec3f lightDir);
+
+    // draws every instance and rebuilds the tile lists
+    void render(const std::vector<Instance>& instances, TGAImage& image, zbuffer& zbuffer);
+    // redraws the tiles touched by the instances listed in moved, before or
+    // after their transform changed; returns the number of tiles drawn
+    int update(const std::vector<Instance>& instances, const std::vector<int>& moved, TGAImage& image, zbuffer& zbuffer);
+
+    int ntiles() const;
+
+private:
+    struct TileRect
+    {
+        int x0, y0, x1, y1;     // in tiles, ends excluded
+    };
+
+    void setTransform(const Instance& instance);
+    TileRect tileBounds(const Instance& instance);
+    void draw(const Instance& instance, TGAImage& image, zbuffer& zbuffer);
+
+    int width;
+    int height;
+    int tilesX;
+    int tilesY;
+    Vec3f light;
+    std::vector<std::vector<int> > tiles;   // instances touching each tile, ascending
+    std::vector<TileRect> bounds;           // per instance, as last drawn
+};
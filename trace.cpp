@@ -0,0 +1,108 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "trace.h"
+
+std::atomic<bool> traceEnabled(false);
+
+struct TraceEvent
+{
+    const char* name;
+    long long start;
+    long long end;
+};
+
+// events of one thread, appended to without locking; the list of threads is
+// only touched when a thread records its first event and when writing
+struct TraceThread
+{
+    int id;
+    const char* role;
+    std::vector<TraceEvent> events;
+
+    TraceThread(int id, const char* role) : id(id), role(role), events() {}
+
+    TraceThread(const TraceThread&) = delete;
+    TraceThread& operator=(const TraceThread&) = delete;
+};
+
+static std::mutex traceMutex;
+static std::vector<TraceThread*> traceThreads;
+static std::string traceFile;
+static std::chrono::steady_clock::time_point traceEpoch = std::chrono::steady_clock::now();
+static std::thread::id traceMainThread;
+static thread_local TraceThread* traceThread = NULL;
+static thread_local const char* traceRole = NULL;
+
+long long traceNow()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - traceEpoch).count();
+}
+
+void traceStart(const char* filename)
+{
+    std::lock_guard<std::mutex> lock(traceMutex);
+    traceFile = filename;
+    traceMainThread = std::this_thread::get_id();
+    traceEnabled = true;
+}
+
+void traceFromEnvironment()
+{
+    const char* filename = getenv("TINYRENDER_TRACE");
+    if (filename && *filename) traceStart(filename);
+}
+
+void traceEvent(const char* name, long long start, long long end)
+{
+    if (!traceThread)
+    {
+        std::lock_guard<std::mutex> lock(traceMutex);
+        const char* role = traceRole ? traceRole : std::this_thread::get_id() == traceMainThread ? "main" : "thread";
+        traceThread = new TraceThread((int)traceThreads.size() + 1, role);
+        traceThreads.push_back(traceThread);
+    }
+    TraceEvent event = { name, start, end };
+    traceThread->events.push_back(event);
+}
+
+void traceThreadRole(const char* role)
+{
+    traceRole = role;
+}
+
+void traceStop()
+{
+    if (!traceEnabled.exchange(false)) return;
+
+    std::lock_guard<std::mutex> lock(traceMutex);
+    FILE* out = fopen(traceFile.c_str(), "w");
+    if (!out)
+    {
+        fprintf(stderr, "can't open trace file %s\n", traceFile.c_str());
+        return;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    const char* separator = "\n";
+    for (size_t t = 0; t < traceThreads.size(); t++)
+    {
+        TraceThread& thread = *traceThreads[t];
+        fprintf(out, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s %d\"}}",
+                separator, thread.id, thread.role, thread.id);
+        separator = ",\n";
+        for (size_t i = 0; i < thread.events.size(); i++)
+        {
+            const TraceEvent& e = thread.events[i];
+            fprintf(out, ",\n{\"name\": \"%s\", \"cat\": \"tinyrender\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                    e.name, thread.id, e.start / 1000., (e.end - e.start) / 1000.);
+        }
+        thread.events.clear();
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+}
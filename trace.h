@@ -0,0 +1,47 @@
+#pragma once
+
+// Scoped timeline markers, written as Chrome trace JSON (chrome://tracing,
+// ui.perfetto.dev) by traceStop. Until traceStart is called, or when the
+// TINYRENDER_TRACE environment variable names no file, a marker costs one
+// test of a global flag.
+
+#include <atomic>
+
+// read by every thread that draws while another may start or stop the trace
+extern std::atomic<bool> traceEnabled;
+
+// starts recording, the calling thread being the one shown as main; the
+// file is written by traceStop
+void traceStart(const char* filename);
+// starts recording into $TINYRENDER_TRACE when it is set
+void traceFromEnvironment();
+// stops recording and writes the events of every thread; threads that are
+// still drawing must be done before this is called
+void traceStop();
+
+// records a span of the calling thread, times in nanoseconds from traceNow;
+// name must outlive the trace, in practice a string literal
+void traceEvent(const char* name, long long start, long long end);
+long long traceNow();
+// names the calling thread in the trace by what it does, e.g. "prefetch";
+// cheap enough to call whether or not a trace is recorded
+void traceThreadRole(const char* role);
+
+struct TraceScope
+{
+    const char* name;
+    long long start;
+
+    TraceScope(const char* name) : name(name), start(traceEnabled.load(std::memory_order_relaxed) ? traceNow() : -1) {}
+    ~TraceScope()
+    {
+        if (start >= 0 && traceEnabled.load(std::memory_order_relaxed)) traceEvent(name, start, traceNow());
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)